@@ -0,0 +1,97 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/log/trivial.hpp>
+
+#include "checkpoint.h"
+
+namespace {
+
+constexpr auto kHeader = "# gupty checkpoint (for --resume)";
+
+constexpr auto kKeyScript = "script";
+constexpr auto kKeySourcesHash = "sources_hash";
+constexpr auto kKeyNumCommands = "commands";
+constexpr auto kKeyCommand = "command";
+constexpr auto kKeyInputMode = "input_mode";
+constexpr auto kKeyOutputMode = "output_mode";
+
+}  // namespace
+
+void writeCheckpoint(const std::string& filename, const Checkpoint& checkpoint) {
+    auto tmp_filename = filename + ".tmp";
+    {
+        std::ofstream out(tmp_filename, std::ios::trunc);
+        out << kHeader << "\n";
+        out << kKeyScript << " " << checkpoint.script << "\n";
+        out << kKeySourcesHash << " " << checkpoint.sources_hash << "\n";
+        out << kKeyNumCommands << " " << checkpoint.num_commands << "\n";
+        out << kKeyCommand << " " << checkpoint.command << "\n";
+        out << kKeyInputMode << " " << checkpoint.input_mode << "\n";
+        out << kKeyOutputMode << " " << checkpoint.output_mode << "\n";
+        if ( ! out) {
+            BOOST_LOG_TRIVIAL(error) << "Could not write checkpoint: " << filename;
+            return;
+        }
+    }
+    std::rename(tmp_filename.c_str(), filename.c_str());
+}
+
+std::optional<Checkpoint> readCheckpoint(const std::string& filename) {
+    std::ifstream in(filename);
+    std::string line;
+    if ( ! std::getline(in, line) || line != kHeader) {
+        return std::nullopt;
+    }
+
+    Checkpoint checkpoint;
+    unsigned int found = 0;
+    while (std::getline(in, line)) {
+        auto spacepos = line.find(" ");
+        auto key = line.substr(0, spacepos);
+        auto value = (spacepos != std::string::npos) ? line.substr(spacepos + 1) : "";
+        try {
+            if (key == kKeyScript) {
+                checkpoint.script = value;
+            } else if (key == kKeySourcesHash) {
+                checkpoint.sources_hash = boost::lexical_cast<uint64_t>(value);
+            } else if (key == kKeyNumCommands) {
+                checkpoint.num_commands = boost::lexical_cast<size_t>(value);
+            } else if (key == kKeyCommand) {
+                checkpoint.command = boost::lexical_cast<size_t>(value);
+            } else if (key == kKeyInputMode) {
+                checkpoint.input_mode = value;
+            } else if (key == kKeyOutputMode) {
+                checkpoint.output_mode = value;
+            } else {
+                continue;
+            }
+        } catch (const boost::bad_lexical_cast&) {
+            return std::nullopt;
+        }
+        found++;
+    }
+    if (found < 6 || checkpoint.command > checkpoint.num_commands) {
+        return std::nullopt;
+    }
+    return checkpoint;
+}
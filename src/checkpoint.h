@@ -0,0 +1,47 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+// Where a script had got up to, saved every so often while it runs, so that
+// `gupty --resume` can carry on from there (eg. after a crash, or an
+// accidental Ctrl-C in the middle of a talk).
+struct Checkpoint {
+    std::string script;
+    // The hash of the script and everything it includes (see hashSources),
+    // and how many commands it had, so that a changed script is noticed.
+    uint64_t sources_hash = 0;
+    size_t num_commands = 0;
+    // The command that was running (counting from 0).
+    size_t command = 0;
+    std::string input_mode;
+    std::string output_mode;
+};
+
+// Writes the checkpoint to a small text file.  (It is written to a temporary
+// file first, and then renamed into place, so that a crash part way through
+// never leaves a broken checkpoint behind.)
+void writeCheckpoint(const std::string& filename, const Checkpoint& checkpoint);
+
+// Reads a checkpoint written by writeCheckpoint, or returns nothing if there
+// isn't one (or it is incomplete).
+std::optional<Checkpoint> readCheckpoint(const std::string& filename);
@@ -0,0 +1,267 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+
+#include <boost/log/trivial.hpp>
+
+#include "command.h"
+
+Enum<Op> OpNames({
+    {CMD_NOTE, Op::NOTE},
+    {CMD_SKIP, Op::SKIP},
+    {CMD_RESUME, Op::RESUME},
+    {CMD_LABEL, Op::LABEL},
+    {CMD_SET_MODE, Op::SET_MODE},
+    {CMD_PAUSE, Op::PAUSE},
+    {CMD_OUTPUT, Op::OUTPUT},
+    {CMD_EXIT, Op::EXIT},
+    {CMD_RUN, Op::RUN},
+    {CMD_RUN_ASYNC, Op::RUN_ASYNC},
+    {CMD_WAIT_JOB, Op::WAIT_JOB},
+    {CMD_PTY_OPEN, Op::PTY_OPEN},
+    {CMD_USE, Op::USE},
+    {CMD_WAIT_TIMEOUT, Op::WAIT_TIMEOUT},
+    {CMD_WAIT_FOR_OUTPUT, Op::WAIT_FOR_OUTPUT},
+    {CMD_WAIT_FOR_OUTPUT_REGEX, Op::WAIT_FOR_OUTPUT_REGEX},
+    {CMD_FILTER_REDACT, Op::FILTER_REDACT},
+    {CMD_FILTER_REDACT_REGEX, Op::FILTER_REDACT_REGEX},
+    {CMD_FILTER_DROP_LINES, Op::FILTER_DROP_LINES},
+    {CMD_FILTER_STRIP_ESCAPES, Op::FILTER_STRIP_ESCAPES},
+    {CMD_FILTER_CLEAR, Op::FILTER_CLEAR},
+    {CMD_PASTE_CHUNK_SIZE, Op::PASTE_CHUNK_SIZE},
+    {CMD_PASTE_DELAY, Op::PASTE_DELAY},
+    {CMD_PASTE_BRACKETED, Op::PASTE_BRACKETED},
+    {CMD_AUTO_KEY_DELAY, Op::AUTO_KEY_DELAY},
+    {CMD_AUTO_KEY_JITTER, Op::AUTO_KEY_JITTER},
+    {CMD_AUTO_ENTER_DELAY, Op::AUTO_ENTER_DELAY},
+    {CMD_WAIT_FOR_ANY_KEY, Op::WAIT_FOR_ANY_KEY},
+    {CMD_PASTE_KEYS, Op::PASTE_KEYS},
+    {CMD_TYPE_KEYS, Op::TYPE_KEYS},
+    {CMD_WAIT_FOR_ENTER, Op::WAIT_FOR_ENTER},
+    {CMD_WAIT_FOR_AND_SEND_ENTER, Op::WAIT_FOR_AND_SEND_ENTER},
+    {CMD_PASTE, Op::PASTE},
+    {CMD_PASTE_LINE, Op::PASTE_LINE},
+    {CMD_TYPE_LINE, Op::TYPE_LINE},
+    {CMD_TYPE, Op::TYPE},
+}, "UNKNOWN", Op::UNKNOWN);
+
+namespace {
+
+const std::map<std::string, Op> opAliases = {
+    {CMD_PASTE_KEY, Op::PASTE_KEYS},
+    {CMD_TYPE_KEY, Op::TYPE_KEYS},
+};
+
+// Bump this whenever the layout of Command (or of the cache file) changes.
+constexpr auto kCompiledMagic = "gupty-compiled-9";
+
+// Sanity limit on counts read from the cache, so that a corrupt file can't
+// cause a huge allocation.
+constexpr uint64_t kMaxCount = 1ULL << 28;
+
+// FNV-1a
+constexpr uint64_t kHashOffset = 14695981039346656037ULL;
+constexpr uint64_t kHashPrime = 1099511628211ULL;
+
+void hash_bytes(uint64_t& h, const char* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= static_cast<unsigned char>(data[i]);
+        h *= kHashPrime;
+    }
+}
+
+void write_u64(std::ostream& out, uint64_t n) {
+    out.write(reinterpret_cast<const char*>(&n), sizeof(n));
+}
+
+void write_string(std::ostream& out, const std::string& s) {
+    write_u64(out, s.size());
+    out.write(s.data(), s.size());
+}
+
+uint64_t read_u64(std::istream& in) {
+    uint64_t n = 0;
+    in.read(reinterpret_cast<char*>(&n), sizeof(n));
+    return n;
+}
+
+std::string read_string(std::istream& in) {
+    auto len = read_u64(in);
+    if ( ! in || len > (1ULL << 32)) {
+        in.setstate(std::ios::failbit);
+        return "";
+    }
+    std::string s(len, '\0');
+    in.read(s.data(), len);
+    return s;
+}
+
+}  // namespace
+
+Op opForName(const std::string& name) {
+    if (auto it = opAliases.find(name); it != opAliases.end()) {
+        return it->second;
+    }
+    return OpNames(name);
+}
+
+bool opUsesPty(Op op) {
+    switch (op) {
+    case Op::WAIT_FOR_OUTPUT:
+    case Op::WAIT_FOR_OUTPUT_REGEX:
+    case Op::PASTE_KEYS:
+    case Op::TYPE_KEYS:
+    case Op::WAIT_FOR_AND_SEND_ENTER:
+    case Op::PASTE:
+    case Op::PASTE_LINE:
+    case Op::TYPE_LINE:
+    case Op::TYPE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+uint64_t hashSources(const std::vector<std::string>& filenames) {
+    uint64_t h = kHashOffset;
+    char buffer[64 * 1024];
+    for (const auto& filename : filenames) {
+        hash_bytes(h, filename.data(), filename.size() + 1);  // include the terminator, as a separator
+        std::ifstream in(filename, std::ios::binary);
+        while (in) {
+            in.read(buffer, sizeof(buffer));
+            hash_bytes(h, buffer, in.gcount());
+        }
+    }
+    return h;
+}
+
+void writeCompiledCommands(const std::string& cache_filename, const Commands& commands, const std::vector<std::string>& sources,
+        const std::map<std::string, std::string>& environment) {
+    // write to a temporary file and then rename it into place, so that a
+    // concurrent reader never sees a partial cache.
+    auto tmp_filename = cache_filename + ".tmp";
+    {
+        std::ofstream out(tmp_filename, std::ios::binary | std::ios::trunc);
+        if ( ! out) {
+            BOOST_LOG_TRIVIAL(error) << "Could not write compiled script cache: " << cache_filename;
+            return;
+        }
+
+        write_string(out, kCompiledMagic);
+        write_u64(out, hashSources(sources));
+        write_u64(out, sources.size());
+        for (const auto& source : sources) {
+            write_string(out, source);
+        }
+        write_u64(out, environment.size());
+        for (const auto& [name, value] : environment) {
+            write_string(out, name);
+            write_string(out, value);
+        }
+
+        write_u64(out, commands.size());
+        for (const auto& cmd : commands) {
+            write_u64(out, static_cast<uint64_t>(cmd.op));
+            write_string(out, cmd.name);
+            write_string(out, cmd.arg);
+            write_string(out, cmd.target);
+            write_u64(out, static_cast<uint64_t>(cmd.value));
+            write_u64(out, cmd.keys.size());
+            for (const auto& key : cmd.keys) {
+                write_string(out, key);
+            }
+            write_u64(out, cmd.setup ? 1 : 0);
+        }
+    }
+    std::rename(tmp_filename.c_str(), cache_filename.c_str());
+}
+
+std::optional<Commands> readCompiledCommands(const std::string& cache_filename, const std::string& script_filename,
+        std::vector<std::string>* sources_out) {
+    std::ifstream in(cache_filename, std::ios::binary);
+    if ( ! in || read_string(in) != kCompiledMagic) {
+        return std::nullopt;
+    }
+
+    auto hash = read_u64(in);
+    auto num_sources = read_u64(in);
+    if (num_sources > kMaxCount) {
+        return std::nullopt;
+    }
+    std::vector<std::string> sources(num_sources);
+    for (auto& source : sources) {
+        source = read_string(in);
+    }
+    if ( ! in || sources.empty() || sources[0] != script_filename || hashSources(sources) != hash) {
+        BOOST_LOG_TRIVIAL(debug) << "Compiled script cache is stale: " << cache_filename;
+        return std::nullopt;
+    }
+
+    auto num_variables = read_u64(in);
+    if (num_variables > kMaxCount) {
+        return std::nullopt;
+    }
+    for (uint64_t i = 0; i < num_variables; i++) {
+        auto name = read_string(in);
+        auto value = read_string(in);
+        auto current = std::getenv(name.c_str());
+        if ( ! in || ! current || value != current) {
+            BOOST_LOG_TRIVIAL(debug) << "Compiled script cache is stale (environment variable " << name << " has changed): " << cache_filename;
+            return std::nullopt;
+        }
+    }
+
+    auto num_commands = read_u64(in);
+    if (num_commands > kMaxCount) {
+        return std::nullopt;
+    }
+    Commands commands(num_commands);
+    for (auto& cmd : commands) {
+        auto op = read_u64(in);
+        if (op >= static_cast<uint64_t>(Op::UNKNOWN)) {
+            return std::nullopt;
+        }
+        cmd.op = static_cast<Op>(op);
+        cmd.name = read_string(in);
+        cmd.arg = read_string(in);
+        cmd.target = read_string(in);
+        cmd.value = static_cast<int64_t>(read_u64(in));
+        auto num_keys = read_u64(in);
+        if (num_keys > kMaxCount) {
+            return std::nullopt;
+        }
+        cmd.keys.resize(num_keys);
+        for (auto& key : cmd.keys) {
+            key = read_string(in);
+        }
+        cmd.setup = read_u64(in) != 0;
+        if ( ! in) {
+            return std::nullopt;
+        }
+    }
+
+    BOOST_LOG_TRIVIAL(debug) << "Loaded " << commands.size() << " commands from compiled script cache: " << cache_filename;
+    if (sources_out) {
+        *sources_out = std::move(sources);
+    }
+    return commands;
+}
+
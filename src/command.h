@@ -0,0 +1,184 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "libgupty.h"
+
+// These are expanded when the script is loaded (so they never become commands).
+constexpr auto CMD_INCLUDE = "include";
+constexpr auto CMD_SET = "set";
+constexpr auto CMD_DEFINE = "define";
+constexpr auto CMD_CALL = "call";
+constexpr auto CMD_REPEAT = "repeat";
+constexpr auto CMD_END = "end";
+
+// A prefix (eg. `setup paste_line cd demo`), which marks a command as one that
+// `--resume` replays, to get back to where the script had got up to.
+constexpr auto CMD_SETUP = "setup";
+// A prefix (eg. `on server wait_for_output ready`), which sends a command's
+// input to (or waits for output from) a pty other than the one in use.
+constexpr auto CMD_ON = "on";
+
+constexpr auto CMD_NOTE = "note";
+constexpr auto CMD_SKIP = "skip";
+constexpr auto CMD_RESUME = "resume";
+constexpr auto CMD_LABEL = "label";
+constexpr auto CMD_SET_MODE = "set_mode";
+constexpr auto CMD_PAUSE = "pause";
+constexpr auto CMD_OUTPUT = "output";
+constexpr auto CMD_EXIT = "exit";
+constexpr auto CMD_RUN = "run";
+constexpr auto CMD_RUN_ASYNC = "run_async";
+constexpr auto CMD_WAIT_JOB = "wait_job";
+constexpr auto CMD_PTY_OPEN = "pty_open";
+constexpr auto CMD_USE = "use";
+constexpr auto CMD_WAIT_TIMEOUT = "wait_timeout";
+constexpr auto CMD_WAIT_FOR_OUTPUT = "wait_for_output";
+constexpr auto CMD_WAIT_FOR_OUTPUT_REGEX = "wait_for_output_regex";
+constexpr auto CMD_FILTER_REDACT = "filter_redact";
+constexpr auto CMD_FILTER_REDACT_REGEX = "filter_redact_regex";
+constexpr auto CMD_FILTER_DROP_LINES = "filter_drop_lines";
+constexpr auto CMD_FILTER_STRIP_ESCAPES = "filter_strip_escapes";
+constexpr auto CMD_FILTER_CLEAR = "filter_clear";
+constexpr auto CMD_PASTE_CHUNK_SIZE = "paste_chunk_size";
+constexpr auto CMD_PASTE_DELAY = "paste_delay";
+constexpr auto CMD_PASTE_BRACKETED = "paste_bracketed";
+constexpr auto CMD_AUTO_KEY_DELAY = "auto_key_delay";
+constexpr auto CMD_AUTO_KEY_JITTER = "auto_key_jitter";
+constexpr auto CMD_AUTO_ENTER_DELAY = "auto_enter_delay";
+
+constexpr auto CMD_WAIT_FOR_ANY_KEY = "wait_for_any_key";
+constexpr auto CMD_PASTE_KEYS = "paste_keys";
+constexpr auto CMD_PASTE_KEY = "paste_key";
+constexpr auto CMD_TYPE_KEYS = "type_keys";
+constexpr auto CMD_TYPE_KEY = "type_key";
+constexpr auto CMD_WAIT_FOR_ENTER = "wait_for_enter";
+constexpr auto CMD_WAIT_FOR_AND_SEND_ENTER = "wait_for_and_send_enter";
+constexpr auto CMD_PASTE = "paste";
+constexpr auto CMD_PASTE_LINE = "paste_line";
+constexpr auto CMD_TYPE_LINE = "type_line";
+constexpr auto CMD_TYPE = "type";
+
+// The operation performed by a command.  These are contiguous from zero, so
+// that they can be used to index directly into a table (see EnumTable).
+enum class Op : uint8_t {
+    NOTE,
+    SKIP,
+    RESUME,
+    LABEL,
+    SET_MODE,
+    PAUSE,
+    OUTPUT,
+    EXIT,
+    RUN,
+    RUN_ASYNC,
+    WAIT_JOB,
+    PTY_OPEN,
+    USE,
+    WAIT_TIMEOUT,
+    WAIT_FOR_OUTPUT,
+    WAIT_FOR_OUTPUT_REGEX,
+    FILTER_REDACT,
+    FILTER_REDACT_REGEX,
+    FILTER_DROP_LINES,
+    FILTER_STRIP_ESCAPES,
+    FILTER_CLEAR,
+    PASTE_CHUNK_SIZE,
+    PASTE_DELAY,
+    PASTE_BRACKETED,
+    AUTO_KEY_DELAY,
+    AUTO_KEY_JITTER,
+    AUTO_ENTER_DELAY,
+    WAIT_FOR_ANY_KEY,
+    PASTE_KEYS,
+    TYPE_KEYS,
+    WAIT_FOR_ENTER,
+    WAIT_FOR_AND_SEND_ENTER,
+    PASTE,
+    PASTE_LINE,
+    TYPE_LINE,
+    TYPE,
+    UNKNOWN,
+};
+
+extern Enum<Op> OpNames;
+
+// Returns the op for a command name (including aliases), or Op::UNKNOWN.
+Op opForName(const std::string& name);
+
+// True for the ops which send input to a pty, or wait for its output (ie.
+// the ones which can be given a pty with CMD_ON).
+bool opUsesPty(Op op);
+
+// A command which has been fully parsed at load time, so that running it
+// doesn't need to look at any strings other than the ones it sends.
+struct Command {
+    Op op = Op::UNKNOWN;
+
+    // The command as it was written in the script (for the monitor).
+    std::string name;
+    std::string arg;
+
+    // What the command acts on: the job name for run_async and wait_job, the
+    // pty name for pty_open and use, or the pty given with `on`.  (For
+    // run_async and pty_open, arg is then just the shell command.)
+    std::string target;
+
+    // Numeric argument: the duration for pause, wait_timeout, paste_delay,
+    // auto_key_delay and auto_enter_delay, the size for paste_chunk_size,
+    // the percentage for auto_key_jitter, the decoded mode for set_mode, output and
+    // paste_bracketed, or the kinds of escape sequences for
+    // filter_strip_escapes.  For skip, the index of the command to carry on
+    // from (ie. the matching resume, or the end of the script).
+    int64_t value = 0;
+
+    // The resolved key codes for paste_keys and type_keys.
+    std::vector<std::string> keys;
+
+    // Replayed when resuming from a checkpoint (see CMD_SETUP).
+    bool setup = false;
+};
+
+using Commands = std::vector<Command>;
+
+using CommandFn = std::function<void(const Command&)>;
+
+
+// Hashes the contents of the given files (in order).
+uint64_t hashSources(const std::vector<std::string>& filenames);
+
+// Writes the commands compiled from the given source files (the script
+// first, then anything it included), and the environment variables that were
+// substituted into them, to a cache file.
+void writeCompiledCommands(const std::string& cache_filename, const Commands& commands, const std::vector<std::string>& sources,
+        const std::map<std::string, std::string>& environment);
+
+// Reads commands from a cache file written by writeCompiledCommands, but only
+// if it was compiled from script_filename, and the contents of the script and
+// all of its includes (and the environment variables it used) are unchanged
+// since.  If sources is given, it is set to the files the commands were
+// compiled from.
+std::optional<Commands> readCompiledCommands(const std::string& cache_filename, const std::string& script_filename,
+        std::vector<std::string>* sources = nullptr);
+
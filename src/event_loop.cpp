@@ -0,0 +1,359 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+#include "libgupty.h"
+
+#ifdef GUPTY_USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#else
+#include <sys/poll.h>
+#endif
+
+namespace {
+
+#ifdef GUPTY_USE_EPOLL
+uint32_t to_epoll(uint32_t events) {
+    uint32_t e = 0;
+    if (events & EventLoop::READABLE) {
+        e |= EPOLLIN;
+    }
+    if (events & EventLoop::WRITABLE) {
+        e |= EPOLLOUT;
+    }
+    return e;
+}
+
+uint32_t from_epoll(uint32_t e) {
+    uint32_t events = 0;
+    if (e & EPOLLIN) {
+        events |= EventLoop::READABLE;
+    }
+    if (e & EPOLLOUT) {
+        events |= EventLoop::WRITABLE;
+    }
+    if (e & (EPOLLHUP | EPOLLRDHUP)) {
+        events |= EventLoop::HANGUP;
+    }
+    if (e & EPOLLERR) {
+        events |= EventLoop::ERROR;
+    }
+    return events;
+}
+#endif
+
+}  // namespace
+
+
+#ifdef GUPTY_USE_EPOLL
+
+EventLoop::EventLoop() {
+    _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    runtime_assert(_epoll_fd >= 0, "Could not create epoll fd.");
+
+    _timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    runtime_assert(_timer_fd >= 0, "Could not create timer fd.");
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = _timer_fd;
+    runtime_assert(epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _timer_fd, &ev) == 0, "Could not watch timer fd.");
+
+    sigemptyset(&_signal_mask);
+}
+
+EventLoop::~EventLoop() {
+    if (_signal_fd >= 0) {
+        close(_signal_fd);
+        pthread_sigmask(SIG_UNBLOCK, &_signal_mask, nullptr);
+    }
+    close(_timer_fd);
+    close(_epoll_fd);
+}
+
+void EventLoop::watchFd(int fd, uint32_t events, FdCallback callback, bool priority) {
+    epoll_event ev{};
+    ev.events = to_epoll(events);
+    ev.data.fd = fd;
+    runtime_assert(epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0, "Could not watch fd.");
+    _fds[fd] = {events, std::move(callback), priority};
+}
+
+void EventLoop::setFdEvents(int fd, uint32_t events) {
+    auto it = _fds.find(fd);
+    if (it == _fds.end() || it->second.events == events) {
+        return;
+    }
+    epoll_event ev{};
+    ev.events = to_epoll(events);
+    ev.data.fd = fd;
+    runtime_assert(epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0, "Could not modify fd.");
+    it->second.events = events;
+}
+
+void EventLoop::unwatchFd(int fd) {
+    if (_fds.erase(fd) > 0) {
+        epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+}
+
+void EventLoop::watchSignal(int signo, Callback callback) {
+    _signals[signo] = std::move(callback);
+    sigaddset(&_signal_mask, signo);
+    runtime_assert(pthread_sigmask(SIG_BLOCK, &_signal_mask, nullptr) == 0, "Could not block signal.");
+
+    bool is_new = (_signal_fd < 0);
+    _signal_fd = signalfd(_signal_fd, &_signal_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    runtime_assert(_signal_fd >= 0, "Could not create signal fd.");
+    if (is_new) {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = _signal_fd;
+        runtime_assert(epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _signal_fd, &ev) == 0, "Could not watch signal fd.");
+    }
+}
+
+void EventLoop::_arm_timers() {
+    itimerspec spec{};
+    if ( ! _timers.empty()) {
+        auto earliest = std::min_element(_timers.begin(), _timers.end(), [] (const auto& a, const auto& b) {
+            return a.second.when < b.second.when;
+        })->second.when;
+        // steady_clock is CLOCK_MONOTONIC on Linux
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(earliest.time_since_epoch()).count();
+        if (ns <= 0) {
+            ns = 1;  // zero would disarm the timer
+        }
+        spec.it_value.tv_sec = ns / 1000000000;
+        spec.it_value.tv_nsec = ns % 1000000000;
+    }
+    runtime_assert(timerfd_settime(_timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr) == 0, "Could not arm timer fd.");
+}
+
+void EventLoop::runOnce(int timeout_ms) {
+    _arm_timers();
+
+    constexpr int kMaxEvents = 16;
+    epoll_event events[kMaxEvents];
+    int n = epoll_wait(_epoll_fd, events, kMaxEvents, timeout_ms);
+    if (n < 0) {
+        runtime_assert(errno == EINTR, "There was a problem waiting for events.");
+        return;
+    }
+
+    // Priority fds go first (epoll returns them in no particular order).
+    std::stable_partition(events, events + n, [this] (const epoll_event& e) {
+        return _is_priority(e.data.fd);
+    });
+
+    for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        if (fd == _timer_fd) {
+            uint64_t expirations;
+            while (read(_timer_fd, &expirations, sizeof(expirations)) > 0) { }
+
+        } else if (fd == _signal_fd) {
+            signalfd_siginfo info;
+            while (read(_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                _dispatch_signal(info.ssi_signo);
+            }
+
+        } else {
+            _dispatch_fd(fd, from_epoll(events[i].events));
+        }
+    }
+
+    _run_due_timers();
+}
+
+#else  // ! GUPTY_USE_EPOLL
+
+int EventLoop::_signal_pipe[2] = {-1, -1};
+
+void EventLoop::_signal_handler(int signo) {
+    auto saved_errno = errno;
+    unsigned char ch = signo;
+    (void) ! write(_signal_pipe[1], &ch, 1);
+    errno = saved_errno;
+}
+
+EventLoop::EventLoop() {
+    if (_signal_pipe[0] < 0) {
+        runtime_assert(pipe(_signal_pipe) == 0, "Could not create signal pipe.");
+        for (int fd : _signal_pipe) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+}
+
+EventLoop::~EventLoop() {
+    for (const auto& [signo, callback] : _signals) {
+        signal(signo, SIG_DFL);
+    }
+}
+
+void EventLoop::watchFd(int fd, uint32_t events, FdCallback callback, bool priority) {
+    _fds[fd] = {events, std::move(callback), priority};
+}
+
+void EventLoop::setFdEvents(int fd, uint32_t events) {
+    if (auto it = _fds.find(fd); it != _fds.end()) {
+        it->second.events = events;
+    }
+}
+
+void EventLoop::unwatchFd(int fd) {
+    _fds.erase(fd);
+}
+
+void EventLoop::watchSignal(int signo, Callback callback) {
+    _signals[signo] = std::move(callback);
+    struct sigaction sa{};
+    sa.sa_handler = _signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    runtime_assert(sigaction(signo, &sa, nullptr) == 0, "Could not install signal handler.");
+}
+
+void EventLoop::_arm_timers() { }
+
+void EventLoop::runOnce(int timeout_ms) {
+    if ( ! _timers.empty()) {
+        auto earliest = std::min_element(_timers.begin(), _timers.end(), [] (const auto& a, const auto& b) {
+            return a.second.when < b.second.when;
+        })->second.when;
+        auto remaining = std::chrono::ceil<std::chrono::milliseconds>(earliest - Clock::now()).count();
+        remaining = std::max<decltype(remaining)>(remaining, 0);
+        if (timeout_ms < 0 || remaining < timeout_ms) {
+            timeout_ms = remaining;
+        }
+    }
+
+    std::vector<pollfd> polls;
+    polls.push_back({_signal_pipe[0], POLLIN, 0});
+    for (const auto& [fd, watch] : _fds) {
+        short e = 0;
+        if (watch.events & READABLE) {
+            e |= POLLIN;
+        }
+        if (watch.events & WRITABLE) {
+            e |= POLLOUT;
+        }
+        polls.push_back({fd, e, 0});
+    }
+
+    int n = poll(polls.data(), polls.size(), timeout_ms);
+    if (n < 0) {
+        runtime_assert(errno == EINTR, "There was a problem waiting for events.");
+        return;
+    }
+
+    if (polls[0].revents & POLLIN) {
+        unsigned char ch;
+        while (read(_signal_pipe[0], &ch, 1) == 1) {
+            _dispatch_signal(ch);
+        }
+    }
+    // Priority fds go first.
+    std::stable_partition(polls.begin() + 1, polls.end(), [this] (const pollfd& p) {
+        return _is_priority(p.fd);
+    });
+    for (size_t i = 1; i < polls.size(); i++) {
+        uint32_t events = 0;
+        if (polls[i].revents & POLLIN) {
+            events |= READABLE;
+        }
+        if (polls[i].revents & POLLOUT) {
+            events |= WRITABLE;
+        }
+        if (polls[i].revents & POLLHUP) {
+            events |= HANGUP;
+        }
+        if (polls[i].revents & (POLLERR | POLLNVAL)) {
+            events |= ERROR;
+        }
+        if (events) {
+            _dispatch_fd(polls[i].fd, events);
+        }
+    }
+
+    _run_due_timers();
+}
+
+#endif  // GUPTY_USE_EPOLL
+
+
+EventLoop::TimerId EventLoop::addTimer(Clock::time_point when, Callback callback) {
+    auto id = _next_timer_id++;
+    _timers[id] = {when, std::move(callback)};
+    return id;
+}
+
+void EventLoop::cancelTimer(TimerId id) {
+    _timers.erase(id);
+}
+
+void EventLoop::_run_due_timers() {
+    auto now = Clock::now();
+    // Collect first, since callbacks may add or cancel timers.
+    std::vector<TimerId> due;
+    for (const auto& [id, timer] : _timers) {
+        if (timer.when <= now) {
+            due.push_back(id);
+        }
+    }
+    for (auto id : due) {
+        auto it = _timers.find(id);
+        if (it == _timers.end()) {
+            continue;  // cancelled by an earlier callback
+        }
+        auto callback = std::move(it->second.callback);
+        _timers.erase(it);
+        callback();
+    }
+}
+
+bool EventLoop::_is_priority(int fd) const {
+    auto it = _fds.find(fd);
+    return it != _fds.end() && it->second.priority;
+}
+
+void EventLoop::_dispatch_fd(int fd, uint32_t events) {
+    // The callback might unwatch the fd (destroying the stored callback), so
+    // call a copy of it.
+    auto it = _fds.find(fd);
+    if (it == _fds.end()) {
+        return;
+    }
+    auto callback = it->second.callback;
+    callback(events);
+}
+
+void EventLoop::_dispatch_signal(int signo) {
+    if (auto it = _signals.find(signo); it != _signals.end()) {
+        it->second();
+    }
+}
+
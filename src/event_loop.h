@@ -0,0 +1,108 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <vector>
+
+#include <signal.h>
+
+#if defined(__linux__) && ! defined(GUPTY_NO_EPOLL)
+#define GUPTY_USE_EPOLL 1
+#endif
+
+// A single-threaded event loop, which owns all of the fds, timers and signals
+// that gupty waits on.  On Linux it is built on epoll(7), with a timerfd for
+// the timers and a signalfd for the signals, so that it sleeps in exactly one
+// place and uses no CPU while idle.  Elsewhere it falls back to poll(2) and a
+// self-pipe for signals.
+//
+// Signals passed to watchSignal() are blocked for normal delivery, so the
+// loop should be created before starting any other threads (so that they
+// inherit the blocked mask), and after forking any children that shouldn't.
+class EventLoop {
+public:
+    enum Events : uint32_t {
+        READABLE = 1,
+        WRITABLE = 2,
+        HANGUP = 4,
+        ERROR = 8,
+    };
+
+    using Clock = std::chrono::steady_clock;
+    using FdCallback = std::function<void(uint32_t events)>;
+    using Callback = std::function<void()>;
+    using TimerId = uint64_t;
+
+    EventLoop();
+    ~EventLoop();
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // Priority fds are dispatched before any others that are ready at the
+    // same time (eg. so that keys are always read before more pty output).
+    void watchFd(int fd, uint32_t events, FdCallback callback, bool priority = false);
+    void setFdEvents(int fd, uint32_t events);
+    void unwatchFd(int fd);
+
+    // Timers fire once.  Cancelling a timer which has already fired is fine.
+    TimerId addTimer(Clock::time_point when, Callback callback);
+    void cancelTimer(TimerId id);
+
+    void watchSignal(int signo, Callback callback);
+
+    // Waits (up to timeout_ms, or forever if -1) for something to happen, and
+    // dispatches everything that did.
+    void runOnce(int timeout_ms);
+
+private:
+    struct Watch {
+        uint32_t events;
+        FdCallback callback;
+        bool priority;
+    };
+
+    struct Timer {
+        Clock::time_point when;
+        Callback callback;
+    };
+
+    void _arm_timers();
+    void _run_due_timers();
+    bool _is_priority(int fd) const;
+    void _dispatch_fd(int fd, uint32_t events);
+    void _dispatch_signal(int signo);
+
+    std::map<int, Watch> _fds;
+    std::map<TimerId, Timer> _timers;
+    TimerId _next_timer_id = 1;
+    std::map<int, Callback> _signals;
+
+#ifdef GUPTY_USE_EPOLL
+    int _epoll_fd = -1;
+    int _timer_fd = -1;
+    int _signal_fd = -1;
+    sigset_t _signal_mask;
+#else
+    static void _signal_handler(int signo);
+    static int _signal_pipe[2];
+#endif
+};
+
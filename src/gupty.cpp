@@ -26,6 +26,8 @@
 #include <boost/program_options.hpp>
 
 #include "lines.h"
+#include "monitor_socket.h"
+#include "replayer.h"
 #include "session.h"
 
 static constexpr auto kVersion = "0.2";
@@ -57,6 +59,8 @@ void show_version() {
 void show_help() {
     show_version();
     std::cout << "Usage: " << cmd_name << " [OPTIONS] <script-file.gupty>" << std::endl;
+    std::cout << "       " << cmd_name << " [OPTIONS] --replay <file.cast>" << std::endl;
+    std::cout << "       " << cmd_name << " --watch <monitor-socket>" << std::endl;
     std::cout << options << std::endl;
 }
 
@@ -67,6 +71,19 @@ static constexpr auto kOptScriptFile = "script-file";
 static constexpr auto kOptShell = "shell";
 static constexpr auto kOptLogFile = "log-file";
 static constexpr auto kOptMonitorFile = "monitor-file";
+static constexpr auto kOptMonitorSocket = "monitor-socket";
+static constexpr auto kOptWatch = "watch";
+static constexpr auto kOptCompiledCache = "compiled-cache";
+static constexpr auto kOptStateFile = "state-file";
+static constexpr auto kOptResume = "resume";
+static constexpr auto kOptKeyTimeout = "key-timeout";
+static constexpr auto kOptFrameRate = "frame-rate";
+static constexpr auto kOptFrameLimit = "frame-limit";
+static constexpr auto kOptRecord = "record";
+static constexpr auto kOptReplay = "replay";
+static constexpr auto kOptSpeed = "speed";
+static constexpr auto kOptSeek = "seek";
+static constexpr auto kOptSeekCommand = "seek-command";
 
 int main(int argc, char *argv[]) {
     int rc = 0;
@@ -82,6 +99,19 @@ int main(int argc, char *argv[]) {
             (kOptShell           , po::value<std::string>()->default_value(""), "use shell instead of default")
             (kOptLogFile         , po::value<std::string>()->default_value("gupty.log"), "log file name")
             (kOptMonitorFile     , po::value<std::string>()->default_value(".gupty.monitor"), "monitor file name")
+            (kOptMonitorSocket   , po::value<std::string>(), "also publish the monitor on this Unix socket, for any number of viewers")
+            (kOptWatch           , po::value<std::string>(), "show the monitor published on this socket (instead of running a script)")
+            (kOptStateFile       , po::value<std::string>()->default_value(".gupty.state"), "state file, where the script's position is saved (for --resume)")
+            (kOptResume          , "carry on from where the state file says the script had got up to (after replaying its setup commands)")
+            (kOptKeyTimeout      , po::value<int>()->default_value(50), "milliseconds to wait for the rest of a multi-char key (eg. to tell ESC apart from arrow keys)")
+            (kOptFrameRate       , po::value<unsigned int>()->default_value(0), "write output at most this many times a second (0 means as it arrives)")
+            (kOptFrameLimit      , po::value<size_t>()->default_value(0), "with --frame-rate, show at most this many KB of output per frame, and skip the rest (0 means no limit)")
+            (kOptRecord          , po::value<std::string>(), "record the session to this file (asciicast v2)")
+            (kOptReplay          , po::value<std::string>(), "play back a recording (instead of running a script)")
+            (kOptSpeed           , po::value<double>()->default_value(1.0), "playback speed multiplier")
+            (kOptSeek            , po::value<double>(), "start playback from this many seconds into the recording")
+            (kOptSeekCommand     , po::value<int>(), "start playback from this script command (number)")
+            (kOptCompiledCache   , po::value<std::string>()->default_value(""), "cache the compiled script in this file, and reuse it if the script is unchanged")
             (kOptScriptFile      , po::value<std::string>(), "script file to use")
             ;
 
@@ -97,7 +127,7 @@ int main(int argc, char *argv[]) {
             exit(0);
         }
 
-        if (vm.count(kOptHelp) || vm.count(kOptScriptFile) == 0) {
+        if (vm.count(kOptHelp) || (vm.count(kOptScriptFile) == 0 && vm.count(kOptReplay) == 0 && vm.count(kOptWatch) == 0)) {
             show_help();
             exit(0);
         }
@@ -107,16 +137,47 @@ int main(int argc, char *argv[]) {
             logging::core::get()->set_filter(logging::trivial::severity >= logging::trivial::debug);
             BOOST_LOG_TRIVIAL(debug) << "Logging level set to 'debug'";
         } else {
-            logging::core::get()->set_filter(logging::trivial::severity >= logging::trivial::error);
+            // (info, so that the latency histograms are logged at exit)
+            logging::core::get()->set_filter(logging::trivial::severity >= logging::trivial::info);
         }
 
         setup_signal_handler(SIGINT, "SIGINT");
         setup_signal_handler(SIGQUIT, "SIGQUIT");
 
+        if (vm.count(kOptWatch)) {
+            MonitorSocket::watch(vm[kOptWatch].as<std::string>(), STDOUT_FILENO);
+            throw exception::normal_exit();
+        }
+
+        if (vm.count(kOptReplay)) {
+            Replayer replayer(vm[kOptReplay].as<std::string>());
+            replayer.setSpeed(vm[kOptSpeed].as<double>());
+            if (vm.count(kOptSeek)) {
+                replayer.seekTime(vm[kOptSeek].as<double>());
+            } else if (vm.count(kOptSeekCommand)) {
+                replayer.seekCommand(vm[kOptSeekCommand].as<int>());
+            }
+            replayer.run();
+            throw exception::normal_exit();
+        }
+
         Session session;
-        auto cmds = session.resolveCommands(readLines(vm[kOptScriptFile].as<std::string>()));
+        auto cmds = session.loadScript(vm[kOptScriptFile].as<std::string>(), vm[kOptCompiledCache].as<std::string>());
         session.setMonitor(vm[kOptMonitorFile].as<std::string>());
+        if (vm.count(kOptMonitorSocket)) {
+            session.setMonitorSocket(vm[kOptMonitorSocket].as<std::string>());
+        }
         session.setShell(vm[kOptShell].as<std::string>());
+        session.setKeyTimeout(vm[kOptKeyTimeout].as<int>());
+        session.setFrameRate(vm[kOptFrameRate].as<unsigned int>());
+        session.setFrameLimit(vm[kOptFrameLimit].as<size_t>() * 1024);
+        session.setStateFile(vm[kOptStateFile].as<std::string>());
+        if (vm.count(kOptResume)) {
+            session.setResume();
+        }
+        if (vm.count(kOptRecord)) {
+            session.setRecord(vm[kOptRecord].as<std::string>());
+        }
         session.init();
         session.run(cmds);
 
@@ -0,0 +1,118 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+
+#include <boost/log/trivial.hpp>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "job.h"
+#include "libgupty.h"
+
+extern char** environ;
+
+Job::Job(const std::string& name, const std::string& command, const std::string& out_filename, const std::string& err_filename)
+: _name(name) {
+    // opened here (rather than by the child) so that any problem is reported
+    // against the job, instead of being hidden in its exit status.
+    auto flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+    auto null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    auto out_fd = open(out_filename.c_str(), flags, 0644);
+    auto err_fd = open(err_filename.c_str(), flags, 0644);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+
+    int result = -1;
+    if (null_fd >= 0 && out_fd >= 0 && err_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, null_fd, STDIN_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+
+        // the event loop blocks the signals it handles (eg. SIGCHLD), and
+        // the child must not inherit that.
+        sigset_t empty;
+        sigemptyset(&empty);
+        sigset_t defaults;
+        sigemptyset(&defaults);
+        sigaddset(&defaults, SIGCHLD);
+        sigaddset(&defaults, SIGWINCH);
+        sigaddset(&defaults, SIGPIPE);
+        posix_spawnattr_setsigmask(&attr, &empty);
+        posix_spawnattr_setsigdefault(&attr, &defaults);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+        const char* argv[] = {"sh", "-c", command.c_str(), nullptr};
+        result = posix_spawn(&_pid, "/bin/sh", &actions, &attr, const_cast<char* const*>(argv), environ);
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    for (auto fd : {null_fd, out_fd, err_fd}) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    runtime_assert(null_fd >= 0 && out_fd >= 0 && err_fd >= 0, "Could not open log files for job " + name);
+    runtime_assert(result == 0, "Could not start job " + name + ": " + strerror(result));
+
+    _running = true;
+    BOOST_LOG_TRIVIAL(debug) << "Started job " << _name << " (pid " << _pid << "): " << command;
+}
+
+Job::~Job() {
+    if (_running) {
+        // it's up to the job to finish (or not) once gupty has gone
+        BOOST_LOG_TRIVIAL(debug) << "Job " << _name << " (pid " << _pid << ") is still running.";
+    }
+}
+
+bool Job::reap() {
+    if ( ! _running) {
+        return false;
+    }
+    pid_t result;
+    do {
+        result = waitpid(_pid, &_status, WNOHANG);
+    } while (result < 0 && errno == EINTR);
+
+    if (result == 0) {
+        return false;
+    }
+    _running = false;
+    if (result < 0) {
+        // somebody else reaped it, so the status is unknown
+        BOOST_LOG_TRIVIAL(error) << "Could not get exit status of job " << _name << ": " << strerror(errno);
+        _status = -1;
+    } else if (WIFEXITED(_status) && WEXITSTATUS(_status) == 0) {
+        BOOST_LOG_TRIVIAL(debug) << "Job " << _name << " finished.";
+    } else if (WIFEXITED(_status)) {
+        BOOST_LOG_TRIVIAL(warning) << "Job " << _name << " exited with status " << WEXITSTATUS(_status);
+    } else if (WIFSIGNALED(_status)) {
+        BOOST_LOG_TRIVIAL(warning) << "Job " << _name << " was killed by signal " << WTERMSIG(_status);
+    }
+    return true;
+}
+
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#pragma once
+
+#include <string>
+
+#include <sys/types.h>
+
+// A shell command running in the background (via `sh -c`).  Its stdin is
+// /dev/null, and its stdout and stderr are appended directly to the given log
+// files as it runs.
+//
+// Nothing here blocks: the owner is expected to call reap() whenever a child
+// might have exited (ie. on SIGCHLD).
+class Job {
+public:
+    Job(const std::string& name, const std::string& command, const std::string& out_filename, const std::string& err_filename);
+    ~Job();
+
+    Job(const Job&) = delete;
+    Job& operator=(const Job&) = delete;
+
+    const std::string& name() const { return _name; }
+    pid_t pid() const { return _pid; }
+    bool running() const { return _running; }
+    // The raw wait(2) status, once the job is no longer running.
+    int status() const { return _status; }
+
+    // Collects the job's exit status, if it has exited.  Returns true if the
+    // job finished during this call.
+    bool reap();
+
+private:
+    std::string _name;
+    pid_t _pid = -1;
+    bool _running = false;
+    int _status = 0;
+};
+
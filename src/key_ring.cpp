@@ -0,0 +1,79 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <algorithm>
+
+#include <boost/log/trivial.hpp>
+
+#include "key_ring.h"
+
+KeyToken::KeyToken(std::string_view key, std::chrono::steady_clock::time_point arrived)
+: _len(std::min(key.size(), sizeof(_data)))
+, _arrived(arrived)
+{
+    std::copy(key.begin(), key.begin() + _len, _data);
+}
+
+bool KeyToken::isControl() const {
+    if (_len != 1) {
+        return false;
+    }
+    unsigned char ch = _data[0];
+    return ch < 0x20;
+}
+
+bool KeyRing::push(std::string_view key, std::chrono::steady_clock::time_point arrived) {
+    if (_size == kCapacity) {
+        KeyToken token(key);
+        if ( ! token.isControl()) {
+            _dropped++;
+            BOOST_LOG_TRIVIAL(debug) << "Key ring full, dropped key (" << _dropped << " dropped so far)";
+            return false;
+        }
+        // make room by dropping the oldest key
+        pop();
+        _dropped++;
+        BOOST_LOG_TRIVIAL(debug) << "Key ring full, dropped oldest key for control key (" << _dropped << " dropped so far)";
+    }
+    _keys[(_head + _size) % kCapacity] = KeyToken(key, arrived);
+    _size++;
+    return true;
+}
+
+KeyToken KeyRing::pop() {
+    if (_size == 0) {
+        return KeyToken();
+    }
+    auto key = _keys[_head];
+    _head = (_head + 1) % kCapacity;
+    _size--;
+    return key;
+}
+
+KeyToken KeyRing::peek() const {
+    if (_size == 0) {
+        return KeyToken();
+    }
+    return _keys[_head];
+}
+
+KeyToken KeyRing::at(size_t i) const {
+    if (i >= _size) {
+        return KeyToken();
+    }
+    return _keys[(_head + i) % kCapacity];
+}
+
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "keycodes.h"
+
+// A single key, as received from stdin, stored inline (no allocation).
+class KeyToken {
+public:
+    KeyToken() = default;
+    explicit KeyToken(std::string_view key, std::chrono::steady_clock::time_point arrived = {});
+
+    std::string_view view() const {
+        return std::string_view(_data, _len);
+    }
+
+    operator std::string_view() const {
+        return view();
+    }
+
+    bool empty() const {
+        return _len == 0;
+    }
+
+    // When the key was read from stdin.
+    std::chrono::steady_clock::time_point arrived() const {
+        return _arrived;
+    }
+
+    // Control keys (eg. Ctrl-C, ESC, Enter) are never dropped from a full KeyRing.
+    bool isControl() const;
+
+private:
+    char _data[kMaxKeyCodeLength] = {};
+    uint8_t _len = 0;
+    std::chrono::steady_clock::time_point _arrived;
+};
+
+// A fixed-capacity FIFO of keys which have been read from stdin, but not yet
+// processed.
+//
+// Whoever fills the ring should only take as many keys as there is space()
+// for (Session leaves the rest of them waiting in stdin).  If more are pushed
+// anyway, then newly arriving ordinary keys are dropped (and counted), and a
+// newly arriving control key evicts the oldest pending key instead, so that
+// eg. Ctrl-C or ESC is never lost.
+class KeyRing {
+public:
+    static constexpr size_t kCapacity = 256;
+
+    // Returns false if the key was dropped.
+    bool push(std::string_view key, std::chrono::steady_clock::time_point arrived = {});
+    KeyToken pop();
+    // Returns the oldest key without removing it (or an empty token).
+    KeyToken peek() const;
+    // Returns the i'th oldest key without removing it (or an empty token).
+    KeyToken at(size_t i) const;
+
+    bool empty() const {
+        return _size == 0;
+    }
+
+    size_t size() const {
+        return _size;
+    }
+
+    size_t space() const {
+        return kCapacity - _size;
+    }
+
+    uint64_t dropped() const {
+        return _dropped;
+    }
+
+private:
+    std::array<KeyToken, kCapacity> _keys;
+    size_t _head = 0;
+    size_t _size = 0;
+    uint64_t _dropped = 0;
+};
+
@@ -14,7 +14,7 @@
  * limitations under the License.
 */
 
-#include <set>
+#include <memory>
 
 #include "keycodes.h"
 
@@ -37,56 +37,68 @@ const std::map<std::string,std::string> keyCodes = {
 
 namespace {
 
-// https://stackoverflow.com/questions/3844909/sorting-a-setstring-on-the-basis-of-length/3846589#3846589
-struct str_length_decreasing {
-    bool operator()(const std::string& lhs, const std::string& rhs) const {
-        const size_t len_lhs = lhs.length();
-        const size_t len_rhs = rhs.length();
+// A DFA over bytes, with one state per trie node.  State 0 is the root, and a
+// transition to state 0 means there is no transition.
+constexpr size_t kMaxTrieNodes = 32;
 
-        if (len_lhs == len_rhs) {
-            return lhs < rhs;
-        }
-        return len_lhs > len_rhs;
-    }
+struct KeyTrie {
+    std::array<std::array<unsigned char, 256>, kMaxTrieNodes> next{};
+    std::array<unsigned char, kMaxTrieNodes> match_length{};  // non-zero if a key code ends at this node
+    std::array<bool, kMaxTrieNodes> has_children{};
+    size_t size = 1;
 };
 
-std::set<std::string, str_length_decreasing> multi_char_keys = {
-    CODE_Backspace,
-    CODE_Up,
-    CODE_Down,
-    CODE_Right,
-    CODE_Left,
-    CODE_Insert,
-    CODE_Home,
-    CODE_PageUp,
-    CODE_Delete,
-    CODE_End,
-    CODE_PageDown,
+constexpr KeyTrie buildKeyTrie() {
+    KeyTrie trie;
+    for (const auto& code : multiCharKeyCodes) {
+        if (code.size() > kMaxKeyCodeLength) {
+            throw "kMaxKeyCodeLength is too small";  // (fails the constexpr evaluation)
+        }
+        size_t node = 0;
+        for (unsigned char ch : code) {
+            if (trie.next[node][ch] == 0) {
+                if (trie.size == kMaxTrieNodes) {
+                    throw "kMaxTrieNodes is too small";  // (fails the constexpr evaluation)
+                }
+                trie.next[node][ch] = trie.size++;
+                trie.has_children[node] = true;
+            }
+            node = trie.next[node][ch];
+        }
+        trie.match_length[node] = code.size();
+    }
+    return trie;
+}
 
-    CODE_Up_2,
-    CODE_Down_2,
-    CODE_Right_2,
-    CODE_Left_2,
-    CODE_Home_2,
-    CODE_End_2,
-};
+constexpr KeyTrie keyTrie = buildKeyTrie();
 
 }  // namespace
 
 
-// Returns the (maximal) number of chars that match one of the multi_char_key sequences.
-unsigned int multi_char_keys_match(std::string::const_iterator b, std::string::const_iterator e) {
-    std::string s(b, e);
-    for (const auto& multi_char_key : multi_char_keys) {
-        if (s.starts_with(multi_char_key)) {
-            return multi_char_key.length();
+KeyMatcher::Scan KeyMatcher::scan(std::string_view s) {
+    Scan result{0, false};
+    size_t node = 0;
+    for (unsigned char ch : s) {
+        node = keyTrie.next[node][ch];
+        if (node == 0) {
+            return result;
+        }
+        if (keyTrie.match_length[node]) {
+            result.length = keyTrie.match_length[node];
         }
     }
-    return 0;
+    // ran out of input
+    result.partial = keyTrie.has_children[node];
+    return result;
+}
+
+// Returns the (maximal) number of chars that match one of the multi_char_key sequences.
+unsigned int multi_char_keys_match(std::string::const_iterator b, std::string::const_iterator e) {
+    return KeyMatcher::longestMatch(std::string_view(std::to_address(b), e - b));
 }
 
 // Returns the (maximal) number of chars that match one of the multi_char_key sequences.
 unsigned int multi_char_keys_match(const std::string& s) {
-    return multi_char_keys_match(s.begin(), s.end());
+    return KeyMatcher::longestMatch(s);
 }
 
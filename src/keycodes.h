@@ -16,8 +16,12 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cstddef>
 #include <map>
 #include <string>
+#include <string_view>
 
 constexpr auto KEY_Enter = "Enter";
 constexpr auto KEY_Return = "Return";
@@ -54,8 +58,148 @@ constexpr auto CODE_Left_2 = "\033[D";
 constexpr auto CODE_Home_2 = "\033[1~";
 constexpr auto CODE_End_2 = "\033[4~";
 
+// Wrapped around pasted text, when the child has asked for bracketed paste.
+constexpr auto CODE_PasteStart = "\033[200~";
+constexpr auto CODE_PasteEnd = "\033[201~";
+// What the child sends to turn bracketed paste on and off.
+constexpr auto CODE_BracketedPasteOn = "\033[?2004h";
+constexpr auto CODE_BracketedPasteOff = "\033[?2004l";
+
 extern const std::map<std::string,std::string> keyCodes;
 
+// Key codes that are more than one char long (or that otherwise need to be
+// recognised as a unit).  The KeyMatcher trie is generated from these at
+// compile time.
+constexpr std::array<std::string_view, 17> multiCharKeyCodes = {
+    CODE_Backspace,
+    CODE_Up,
+    CODE_Down,
+    CODE_Right,
+    CODE_Left,
+    CODE_Insert,
+    CODE_Home,
+    CODE_PageUp,
+    CODE_Delete,
+    CODE_End,
+    CODE_PageDown,
+
+    CODE_Up_2,
+    CODE_Down_2,
+    CODE_Right_2,
+    CODE_Left_2,
+    CODE_Home_2,
+    CODE_End_2,
+};
+
+// The length of the longest entry in multiCharKeyCodes.
+constexpr size_t kMaxKeyCodeLength = 4;
+
+// Splits a stream of input into keys, using a trie of multiCharKeyCodes.
+//
+// Each call to longestMatch()/scan() only looks at as many chars as the
+// longest key code, however long the input is.  feed() can be called with
+// successive reads from an fd: a key code that is split across two reads is
+// held back until the rest of it arrives (or until flush() is called, eg.
+// after a timeout, which is how a lone ESC is told apart from the start of
+// an arrow key).
+class KeyMatcher {
+public:
+    struct Scan {
+        size_t length;  // length of the longest key code at the start of the input (0 if none)
+        bool partial;   // the input ran out while it could still have been the start of a (longer) key code
+    };
+
+    static Scan scan(std::string_view s);
+
+    // Returns the (maximal) number of chars that match one of the multi-char key codes.
+    static size_t longestMatch(std::string_view s) {
+        return scan(s).length;
+    }
+
+    // Splits s into keys, calling emit(std::string_view) for each one.  Any
+    // trailing partial key code is held back for the next call.
+    template <class Emit>
+    void feed(std::string_view s, Emit&& emit);
+
+    // Emits anything that was held back, as it is.
+    template <class Emit>
+    void flush(Emit&& emit);
+
+    bool pending() const {
+        return _pending_len > 0;
+    }
+
+private:
+    // Splits s into keys, and returns how much of it was used.  If final is
+    // false, stops before a trailing partial key code.
+    template <class Emit>
+    static size_t _tokenize(std::string_view s, bool final, Emit& emit);
+
+    char _pending[kMaxKeyCodeLength];
+    size_t _pending_len = 0;
+};
+
+template <class Emit>
+size_t KeyMatcher::_tokenize(std::string_view s, bool final, Emit& emit) {
+    size_t pos = 0;
+    while (pos < s.size()) {
+        auto [len, partial] = scan(s.substr(pos));
+        if (partial && ! final) {
+            break;
+        }
+        if (len == 0) {
+            // unrecognised.  so just peel off 1 char.
+            len = 1;
+        }
+        emit(s.substr(pos, len));
+        pos += len;
+    }
+    return pos;
+}
+
+template <class Emit>
+void KeyMatcher::feed(std::string_view s, Emit&& emit) {
+    size_t offset = 0;
+    if (_pending_len > 0) {
+        // Resolve the held back chars first, along with just enough of s to
+        // be sure of completing any key code that starts in them.
+        char tmp[kMaxKeyCodeLength * 2];
+        auto extra = std::min(s.size(), kMaxKeyCodeLength);
+        std::copy(_pending, _pending + _pending_len, tmp);
+        std::copy(s.begin(), s.begin() + extra, tmp + _pending_len);
+        std::string_view joined(tmp, _pending_len + extra);
+
+        size_t pos = 0;
+        while (pos < _pending_len) {
+            auto [len, partial] = scan(joined.substr(pos));
+            if (partial) {
+                // still incomplete, and all of s has been used
+                std::copy(joined.begin() + pos, joined.end(), _pending);
+                _pending_len = joined.size() - pos;
+                return;
+            }
+            if (len == 0) {
+                len = 1;
+            }
+            emit(joined.substr(pos, len));
+            pos += len;
+        }
+        offset = pos - _pending_len;
+        _pending_len = 0;
+    }
+
+    auto rest = s.substr(offset);
+    auto used = _tokenize(rest, false, emit);
+    std::copy(rest.begin() + used, rest.end(), _pending);
+    _pending_len = rest.size() - used;
+}
+
+template <class Emit>
+void KeyMatcher::flush(Emit&& emit) {
+    _tokenize(std::string_view(_pending, _pending_len), true, emit);
+    _pending_len = 0;
+}
+
 // Returns the (maximal) number of chars that match one of the multi_char_key sequences.
 unsigned int multi_char_keys_match(std::string::const_iterator b, std::string::const_iterator e);
 
@@ -16,15 +16,19 @@
 
 #pragma once
 
+#include <functional>
 #include <map>
 #include <string>
+#include <string_view>
 
+// std::less<> makes lookups by std::string_view possible, without having to
+// construct a std::string for every key.
 template <class Action, Action None>
-class Keymap : public std::map<std::string, Action> {
+class Keymap : public std::map<std::string, Action, std::less<>> {
 public:
-    using std::map<std::string, Action>::map;
+    using std::map<std::string, Action, std::less<>>::map;
 
-    Action get(const std::string& key) const {
+    Action get(std::string_view key) const {
         if (auto it = this->find(key); it != this->end()) {
             return it->second;
         } else {
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+#include "latency_histogram.h"
+
+namespace {
+
+std::string format_duration(std::chrono::nanoseconds d) {
+    std::ostringstream oss;
+    oss << std::setprecision(3);
+    double ns = d.count();
+    if (ns < 1e3) {
+        oss << ns << "ns";
+    } else if (ns < 1e6) {
+        oss << ns / 1e3 << "us";
+    } else if (ns < 1e9) {
+        oss << ns / 1e6 << "ms";
+    } else {
+        oss << ns / 1e9 << "s";
+    }
+    return oss.str();
+}
+
+}  // namespace
+
+size_t LatencyHistogram::_bucket(uint64_t ns) {
+    if (ns < kSubBuckets) {
+        return ns;
+    }
+    unsigned msb = std::bit_width(ns) - 1;
+    if (msb > kMaxBits) {
+        return kNumBuckets - 1;
+    }
+    // the top kSubBucketBits bits below the msb pick the linear bucket
+    unsigned shift = msb - kSubBucketBits;
+    return (shift + 1) * kSubBuckets + ((ns >> shift) - kSubBuckets);
+}
+
+uint64_t LatencyHistogram::_bucket_high(size_t bucket) {
+    if (bucket < kSubBuckets) {
+        return bucket;
+    }
+    unsigned shift = bucket / kSubBuckets - 1;
+    uint64_t sub = bucket % kSubBuckets;
+    return ((kSubBuckets + sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(Duration d) {
+    uint64_t ns = std::max<int64_t>(d.count(), 0);
+    _buckets[_bucket(ns)]++;
+    _count++;
+    _sum += ns;
+    _max = std::max(_max, ns);
+}
+
+LatencyHistogram::Duration LatencyHistogram::percentile(double percent) const {
+    if (_count == 0) {
+        return Duration(0);
+    }
+    auto wanted = static_cast<uint64_t>(std::ceil(_count * percent / 100.0));
+    wanted = std::clamp<uint64_t>(wanted, 1, _count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kNumBuckets; i++) {
+        seen += _buckets[i];
+        if (seen >= wanted) {
+            return Duration(std::min(_bucket_high(i), _max));
+        }
+    }
+    return Duration(_max);
+}
+
+std::string LatencyHistogram::summary() const {
+    std::ostringstream oss;
+    oss << "n=" << _count;
+    if (_count > 0) {
+        oss << " mean=" << format_duration(mean())
+            << " p50=" << format_duration(percentile(50))
+            << " p90=" << format_duration(percentile(90))
+            << " p99=" << format_duration(percentile(99))
+            << " p99.9=" << format_duration(percentile(99.9))
+            << " max=" << format_duration(max());
+    }
+    return oss.str();
+}
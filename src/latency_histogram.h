@@ -0,0 +1,66 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// A histogram of durations, in the style of HdrHistogram: each power of two
+// (of nanoseconds) is split into kSubBuckets linear buckets, so every value is
+// kept to within about 3%, from 1ns up to about 18 minutes.  Recording a value
+// is a handful of integer operations, with no allocation, so it is cheap
+// enough to leave on all the time.
+class LatencyHistogram {
+public:
+    using Duration = std::chrono::nanoseconds;
+
+    static constexpr unsigned kSubBucketBits = 5;
+    static constexpr uint64_t kSubBuckets = 1 << kSubBucketBits;
+    // anything longer than 2^kMaxBits ns is counted in the last bucket
+    static constexpr unsigned kMaxBits = 40;
+    static constexpr size_t kNumBuckets = (kMaxBits - kSubBucketBits + 2) * kSubBuckets;
+
+    void record(Duration d);
+
+    uint64_t count() const {
+        return _count;
+    }
+
+    // The smallest recorded value that at least `percent` of values are no
+    // larger than (to within the bucket resolution).
+    Duration percentile(double percent) const;
+    Duration max() const {
+        return Duration(_max);
+    }
+    Duration mean() const {
+        return Duration(_count == 0 ? 0 : _sum / _count);
+    }
+
+    // eg. "n=1234 mean=15us p50=12us p90=20us p99=45us p99.9=120us max=1.2ms"
+    std::string summary() const;
+
+private:
+    static size_t _bucket(uint64_t ns);
+    static uint64_t _bucket_high(size_t bucket);
+
+    std::array<uint64_t, kNumBuckets> _buckets = {};
+    uint64_t _count = 0;
+    uint64_t _sum = 0;
+    uint64_t _max = 0;
+};
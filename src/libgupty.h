@@ -16,8 +16,15 @@
 
 #pragma once
 
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
 #include <exception>
+#include <initializer_list>
+#include <stdexcept>
 #include <string>
+#include <utility>
 
 #include <boost/bimap.hpp>
 #include <boost/container/allocator.hpp>
@@ -27,6 +34,14 @@ namespace exception {
 class normal_exit : public std::exception {};
 class early_exit : public std::exception {};
 
+// Abandons the current command, and carries on running the script from
+// command number `index` (counting from 0) instead.
+class seek : public std::exception {
+public:
+    explicit seek(size_t index) : index(index) {}
+    size_t index;
+};
+
 }  // namespace exception
 
 inline void runtime_assert(bool result, const std::string& msg) {
@@ -35,9 +50,16 @@ inline void runtime_assert(bool result, const std::string& msg) {
     }
 }
 
-// FIXME: add an "errno_assert" which is like runtime_assert, but uses strerror.
-// It will also need to reset errno prior to evaluating the expression, so it
-// will need to be a macro.
+// Like runtime_assert, but for system calls (which set errno when they fail):
+// the message ends with strerror(errno).  errno is reset before the expression
+// is evaluated, so that a stale value is never reported.
+#define errno_assert(expr, msg) \
+    do { \
+        errno = 0; \
+        if ( ! (expr)) { \
+            throw std::runtime_error(std::string(msg) + ": " + std::strerror(errno)); \
+        } \
+    } while (0)
 
 
 inline char* raw_c_str(const std::string& s) {
@@ -75,3 +97,27 @@ private:
     T _defaultValue;
 };
 
+
+// A fixed-size table indexed directly by the values of the enum class E, which
+// must be contiguous from zero up to (but not including) Count.
+template <class E, class T, E Count>
+class EnumTable {
+public:
+    EnumTable(std::initializer_list<std::pair<E, T>> list) {
+        for (const auto& [e, t] : list) {
+            (*this)[e] = t;
+        }
+    }
+
+    T& operator[](E e) {
+        return _table.at(static_cast<size_t>(e));
+    }
+
+    const T& operator[](E e) const {
+        return _table.at(static_cast<size_t>(e));
+    }
+
+private:
+    std::array<T, static_cast<size_t>(Count)> _table;
+};
+
@@ -23,6 +23,10 @@ Mode::Auto::Keys::Keys()
     {"\033", Actions::SwitchToCommandMode},
     {"f",  Actions::SwitchToFullAuto},
     {"s",  Actions::SwitchToSemiAuto},
+    {"+",  Actions::Faster},
+    {"=",  Actions::Faster},
+    {"-",  Actions::Slower},
+    {" ",  Actions::TogglePause},
     {"\r", Actions::Return},
 } { }
 
@@ -27,6 +27,9 @@ enum class Actions {
     SwitchToCommandMode,
     SwitchToFullAuto,
     SwitchToSemiAuto,
+    Faster,
+    Slower,
+    TogglePause,
     Return,
     None,
 };
@@ -22,12 +22,16 @@ Mode::Command::Keys::Keys()
     {"\034", Actions::SigQuit},
     {"i",  Actions::SwitchToInsertMode},
     {"p",  Actions::SwitchToPassthroughMode},
-    //{"a",  Actions::SwitchToAutoMode},
+    {"a",  Actions::SwitchToAutoMode},
     {"q",  Actions::Quit},
     //{"\r", Actions::Return},
     {"r",  Actions::ResizeWindow},
-    //{"j",  Actions::NextLine},
-    //{"k",  Actions::PrevLine},
+    {"l",  Actions::ShowLatency},
+    {"j",  Actions::NextLine},
+    {"k",  Actions::PrevLine},
+    {"]",  Actions::NextSection},
+    {"[",  Actions::PrevSection},
+    {"/",  Actions::JumpToLabel},
     //{"s",  Actions::TurnOffStdout},
     //{"v",  Actions::TurnOnStdout},
     //{"o",  Actions::ToggleStdout},
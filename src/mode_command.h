@@ -32,9 +32,13 @@ enum class Actions {
     ResizeWindow,
     NextLine,
     PrevLine,
+    NextSection,
+    PrevSection,
+    JumpToLabel,
     TurnOffStdout,
     TurnOnStdout,
     ToggleStdout,
+    ShowLatency,
     None,
 };
 
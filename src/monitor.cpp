@@ -0,0 +1,120 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <cerrno>
+
+#include <boost/log/trivial.hpp>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libgupty.h"
+#include "monitor.h"
+
+Monitor::Monitor(const std::string& filename) {
+    _fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    runtime_assert(_fd >= 0, "Could not open monitor file.");
+    _thread = std::thread([this] { _writer(); });
+}
+
+Monitor::~Monitor() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _cv.notify_one();
+    // the writer finishes off any pending frame before it exits
+    _thread.join();
+    close(_fd);
+}
+
+void Monitor::show(const MonitorRows& rows) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        // any frame that hasn't been written yet is simply replaced
+        _pending = rows;
+        _has_pending = true;
+    }
+    _cv.notify_one();
+}
+
+void Monitor::_writer() {
+    MonitorRows rows;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait(lock, [this] { return _has_pending || _stopping; });
+            if ( ! _has_pending) {
+                return;
+            }
+            rows.swap(_pending);
+            _has_pending = false;
+        }
+
+        _encode(rows);
+        size_t written = 0;
+        while (written < _buf.size()) {
+            auto count = write(_fd, _buf.data() + written, _buf.size() - written);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                BOOST_LOG_TRIVIAL(error) << "Could not write to monitor file, errno " << errno;
+                break;
+            }
+            written += count;
+        }
+    }
+}
+
+void Monitor::_encode(const MonitorRows& rows) {
+    _buf.clear();
+    if ( ! _drawn) {
+        _buf += CODE_clearscr;
+        _rows.clear();
+        _drawn = true;
+    }
+    encodeMonitorRows(_rows, rows, _buf);
+    _rows = rows;
+}
+
+void encodeMonitorRows(const MonitorRows& from, const MonitorRows& to, std::string& buf) {
+    auto start = buf.size();
+    for (size_t i = 0; i < to.size(); i++) {
+        if (i < from.size() && from[i] == to[i]) {
+            continue;
+        }
+        // move to the start of the (1-based) row, and replace it
+        buf += "\033[";
+        buf += std::to_string(i + 1);
+        buf += ";1H";
+        buf += to[i];
+        buf += CODE_clear_to_eol;
+    }
+    if (to.size() < from.size()) {
+        // the frame got shorter, so blank out everything below it
+        buf += "\033[";
+        buf += std::to_string(to.size() + 1);
+        buf += ";1H";
+        buf += CODE_clear_to_eos;
+    }
+    if (buf.size() > start) {
+        // leave the cursor below the frame, so that tail's own output doesn't land on it
+        buf += "\033[";
+        buf += std::to_string(to.size() + 1);
+        buf += ";1H";
+    }
+}
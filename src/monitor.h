@@ -0,0 +1,72 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using MonitorRows = std::vector<std::string>;
+
+constexpr auto CODE_clearscr = "\033[3J\033[H\033[2J";
+constexpr auto CODE_clear_to_eol = "\033[K";
+constexpr auto CODE_clear_to_eos = "\033[J";
+
+// Appends what it takes to turn a screen showing the `from` rows into one
+// showing the `to` rows to buf: each row which differs is addressed directly
+// (by moving the cursor to it) and replaced, anything below a shorter frame is
+// blanked out, and the cursor is left below the frame.
+void encodeMonitorRows(const MonitorRows& from, const MonitorRows& to, std::string& buf);
+
+// Draws frames (a list of rows) into the monitor file, which is meant to be
+// followed with `tail -f`.  Only the first frame clears the screen; after that,
+// only the rows which differ from the previous frame are emitted, each one
+// addressed directly by moving the cursor to it.
+//
+// All of the encoding and writing happens on a background thread, so that
+// show() never waits on the filesystem.  If frames arrive faster than they can
+// be written, only the latest one is kept.  Each frame is written with a
+// single write(2).
+class Monitor {
+public:
+    explicit Monitor(const std::string& filename);
+    ~Monitor();
+
+    void show(const MonitorRows& rows);
+
+private:
+    void _writer();
+    void _encode(const MonitorRows& rows);
+
+    int _fd = -1;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    MonitorRows _pending;
+    bool _has_pending = false;
+    bool _stopping = false;
+
+    // only touched by the writer thread
+    MonitorRows _rows;
+    bool _drawn = false;
+    std::string _buf;
+
+    std::thread _thread;
+};
+
@@ -0,0 +1,323 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <boost/log/trivial.hpp>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "libgupty.h"
+#include "monitor_socket.h"
+
+namespace {
+
+// Any more viewers than this are turned away.
+constexpr size_t kMaxViewers = 64;
+
+// A viewer going away mustn't kill gupty with SIGPIPE.  (Where there's no
+// MSG_NOSIGNAL, SO_NOSIGPIPE is set on each viewer's socket instead.)
+#ifdef MSG_NOSIGNAL
+constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+constexpr int kSendFlags = 0;
+#endif
+
+sockaddr_un socket_address(const std::string& path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    runtime_assert(path.size() < sizeof(addr.sun_path), "Monitor socket path is too long: " + path);
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return addr;
+}
+
+void set_nonblocking(int fd) {
+    errno_assert(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0, "Could not make monitor socket non-blocking");
+    errno_assert(fcntl(fd, F_SETFD, FD_CLOEXEC) == 0, "Could not set close-on-exec on monitor socket");
+}
+
+}  // namespace
+
+MonitorSocket::MonitorSocket(const std::string& path)
+: _path(path) {
+    auto addr = socket_address(path);
+
+    // A socket left behind by a gupty which didn't exit cleanly is in the
+    // way, but one which is still being listened on isn't ours to take over.
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        errno_assert(probe >= 0, "Could not create socket");
+        bool in_use = connect(probe, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+        close(probe);
+        runtime_assert( ! in_use, "Monitor socket is already in use: " + path);
+        unlink(path.c_str());
+    }
+
+    _listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    errno_assert(_listen_fd >= 0, "Could not create monitor socket");
+    set_nonblocking(_listen_fd);
+    errno_assert(bind(_listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0, "Could not bind monitor socket " + path);
+    errno_assert(listen(_listen_fd, 16) == 0, "Could not listen on monitor socket");
+
+    errno_assert(pipe(_wake_pipe) == 0, "Could not create monitor socket wakeup pipe");
+    for (int fd : _wake_pipe) {
+        set_nonblocking(fd);
+    }
+
+    _thread = std::thread([this] { _server(); });
+}
+
+MonitorSocket::~MonitorSocket() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    (void) ! write(_wake_pipe[1], "", 1);
+    // the server sends out any pending frame (as far as it can without waiting) before it exits
+    _thread.join();
+
+    while ( ! _viewers.empty()) {
+        _remove(_viewers.begin()->first);
+    }
+    close(_listen_fd);
+    close(_wake_pipe[0]);
+    close(_wake_pipe[1]);
+    unlink(_path.c_str());
+}
+
+void MonitorSocket::show(const MonitorRows& rows) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        // any frame that hasn't been published yet is simply replaced
+        _pending = rows;
+        _has_pending = true;
+    }
+    // (if the pipe is full, then the server is going to wake up anyway)
+    (void) ! write(_wake_pipe[1], "", 1);
+}
+
+void MonitorSocket::_server() {
+    std::vector<pollfd> polls;
+    MonitorRows rows;
+    while (true) {
+        polls.clear();
+        polls.push_back({_wake_pipe[0], POLLIN, 0});
+        polls.push_back({_listen_fd, POLLIN, 0});
+        for (const auto& [fd, viewer] : _viewers) {
+            // (always watch for input, which is how a viewer going away is noticed)
+            polls.push_back({fd, static_cast<short>(POLLIN | (viewer.frame ? POLLOUT : 0)), 0});
+        }
+
+        if (poll(polls.data(), polls.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            BOOST_LOG_TRIVIAL(error) << "Could not poll monitor socket, errno " << errno;
+            return;
+        }
+
+        // viewers first, so that none of them can have been replaced (by one
+        // with the same fd) since polling
+        for (size_t i = 2; i < polls.size(); i++) {
+            auto fd = polls[i].fd;
+            auto revents = polls[i].revents;
+            auto viewer = _viewers.find(fd);
+            if (viewer == _viewers.end()) {
+                continue;
+            }
+            bool ok = true;
+            if (revents & POLLIN) {
+                // viewers have nothing to say, so this is just them going away
+                char buffer[256];
+                auto count = recv(fd, buffer, sizeof(buffer), 0);
+                ok = count > 0 || (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
+            }
+            if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                ok = false;
+            }
+            if (ok && (revents & POLLOUT)) {
+                ok = _send(fd, viewer->second);
+            }
+            if ( ! ok) {
+                _remove(fd);
+            }
+        }
+
+        if (polls[0].revents) {
+            char buffer[64];
+            while (read(_wake_pipe[0], buffer, sizeof(buffer)) > 0) { }
+            bool stopping;
+            bool has_pending;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                stopping = _stopping;
+                has_pending = _has_pending;
+                rows.swap(_pending);
+                _has_pending = false;
+            }
+            if (has_pending) {
+                _publish(rows);
+            }
+            if (stopping) {
+                return;
+            }
+        }
+
+        if (polls[1].revents & POLLIN) {
+            _accept();
+        }
+    }
+}
+
+void MonitorSocket::_accept() {
+    while (true) {
+        int fd = accept(_listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                BOOST_LOG_TRIVIAL(error) << "Could not accept monitor viewer, errno " << errno;
+            }
+            return;
+        }
+        if (_viewers.size() >= kMaxViewers) {
+            BOOST_LOG_TRIVIAL(warning) << "Too many monitor viewers, turning one away.";
+            close(fd);
+            continue;
+        }
+        try {
+            set_nonblocking(fd);
+        } catch (const std::runtime_error& e) {
+            BOOST_LOG_TRIVIAL(error) << e.what();
+            close(fd);
+            continue;
+        }
+#ifdef SO_NOSIGPIPE
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+        auto& viewer = _viewers[fd];
+        BOOST_LOG_TRIVIAL(info) << "Monitor viewer connected (" << _viewers.size() << " connected).";
+        if (_frame) {
+            // start it off with a clean screen, and the current frame
+            viewer.frame = std::make_shared<const std::string>(CODE_clearscr + *_frame);
+            if ( ! _send(fd, viewer)) {
+                _remove(fd);
+            }
+        }
+    }
+}
+
+void MonitorSocket::_publish(const MonitorRows& rows) {
+    // a complete redraw (from row 1), and then blank out anything that a
+    // longer frame left below it
+    auto frame = std::make_shared<std::string>();
+    encodeMonitorRows({}, rows, *frame);
+    *frame += CODE_clear_to_eos;
+    _frame = frame;
+
+    std::vector<int> gone;
+    for (auto& [fd, viewer] : _viewers) {
+        if (viewer.frame) {
+            // still busy with an earlier frame, so only keep the latest one
+            if (viewer.next) {
+                viewer.dropped++;
+            }
+            viewer.next = _frame;
+        } else {
+            viewer.frame = _frame;
+            viewer.sent = 0;
+            if ( ! _send(fd, viewer)) {
+                gone.push_back(fd);
+            }
+        }
+    }
+    for (auto fd : gone) {
+        _remove(fd);
+    }
+}
+
+bool MonitorSocket::_send(int fd, Viewer& viewer) {
+    while (viewer.frame) {
+        const auto& data = *viewer.frame;
+        while (viewer.sent < data.size()) {
+            auto count = send(fd, data.data() + viewer.sent, data.size() - viewer.sent, kSendFlags);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // carry on when the viewer has caught up (see _server)
+                return true;
+            }
+            if (count <= 0) {
+                return false;
+            }
+            viewer.sent += count;
+        }
+        viewer.frame = std::move(viewer.next);
+        viewer.next.reset();
+        viewer.sent = 0;
+    }
+    return true;
+}
+
+void MonitorSocket::_remove(int fd) {
+    auto it = _viewers.find(fd);
+    if (it == _viewers.end()) {
+        return;
+    }
+    BOOST_LOG_TRIVIAL(info) << "Monitor viewer disconnected (" << it->second.dropped << " frames dropped for it).";
+    close(fd);
+    _viewers.erase(it);
+}
+
+void MonitorSocket::watch(const std::string& path, int out_fd) {
+    auto addr = socket_address(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    errno_assert(fd >= 0, "Could not create socket");
+    errno_assert(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0, "Could not connect to monitor socket " + path);
+
+    char buffer[64 * 1024];
+    while (true) {
+        auto count = read(fd, buffer, sizeof(buffer));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            break;
+        }
+        for (ssize_t written = 0; written < count; ) {
+            auto n = write(out_fd, buffer + written, count - written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            errno_assert(n > 0, "Could not write monitor output");
+            written += n;
+        }
+    }
+    close(fd);
+}
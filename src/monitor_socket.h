@@ -0,0 +1,88 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "monitor.h"
+
+// Publishes monitor frames to any number of viewers, connected to a Unix
+// socket (eg. with `gupty --watch <socket>`).
+//
+// Each frame is rendered once (as a complete redraw, so that it doesn't
+// depend on what a viewer was showing before), and the same bytes are sent to
+// every viewer.  A viewer which connects is sent the current frame straight
+// away.  A viewer which can't keep up never holds anything else up: while it
+// is still being sent one frame, only the latest of the frames after that is
+// kept for it, and the rest are dropped.
+//
+// Everything (including accepting viewers) happens on a background thread,
+// so that show() never waits on the viewers.  (The thread polls for itself,
+// rather than using an EventLoop, which would share signal handling with the
+// session's loop on some platforms.)
+class MonitorSocket {
+public:
+    explicit MonitorSocket(const std::string& path);
+    ~MonitorSocket();
+
+    void show(const MonitorRows& rows);
+
+    // Connects to a monitor socket, and copies what it sends to out_fd, until
+    // gupty goes away.
+    static void watch(const std::string& path, int out_fd);
+
+private:
+    using Frame = std::shared_ptr<const std::string>;
+
+    struct Viewer {
+        // The frame being sent, and how much of it has been sent so far.
+        Frame frame;
+        size_t sent = 0;
+        // The latest frame to have arrived since (if any).
+        Frame next;
+        uint64_t dropped = 0;
+    };
+
+    void _server();
+    void _accept();
+    void _publish(const MonitorRows& rows);
+    // Sends as much as the viewer will take, and returns false if it has gone away.
+    bool _send(int fd, Viewer& viewer);
+    void _remove(int fd);
+
+    std::string _path;
+    int _listen_fd = -1;
+    int _wake_pipe[2] = {-1, -1};
+
+    std::mutex _mutex;
+    MonitorRows _pending;
+    bool _has_pending = false;
+    bool _stopping = false;
+
+    // only touched by the server thread
+    std::map<int, Viewer> _viewers;
+    // The latest frame (for viewers which connect later).
+    Frame _frame;
+
+    std::thread _thread;
+};
@@ -0,0 +1,406 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "output_filter.h"
+
+namespace {
+
+constexpr char kEsc = '\033';
+constexpr char kBel = '\a';
+
+// Escape sequences that are being buffered (to find out what kind they are)
+// are given up on (and passed through as they are) if they get this long.
+constexpr size_t kMaxEscapeLength = 64;
+
+// (the same as std::regex's ECMAScript, where `.` doesn't match line endings)
+const boost::match_flag_type kMatchFlags = boost::match_default | boost::match_not_dot_newline;
+
+bool in_range(char ch, unsigned char low, unsigned char high) {
+    auto uch = static_cast<unsigned char>(ch);
+    return uch >= low && uch <= high;
+}
+
+}  // namespace
+
+void ByteSet::add(unsigned char ch) {
+    if ( ! _table[ch]) {
+        _table[ch] = true;
+        _bytes.push_back(ch);
+    }
+}
+
+void ByteSet::clear() {
+    _table.fill(false);
+    _bytes.clear();
+}
+
+const char* ByteSet::find(const char* begin, const char* end) const {
+    auto p = begin;
+#ifdef __SSE2__
+    if ( ! _bytes.empty() && _bytes.size() <= kMaxSimdBytes) {
+        __m128i needles[kMaxSimdBytes];
+        for (size_t i = 0; i < _bytes.size(); i++) {
+            needles[i] = _mm_set1_epi8(static_cast<char>(_bytes[i]));
+        }
+        while (end - p >= 16) {
+            auto block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            auto hits = _mm_cmpeq_epi8(block, needles[0]);
+            for (size_t i = 1; i < _bytes.size(); i++) {
+                hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[i]));
+            }
+            auto mask = _mm_movemask_epi8(hits);
+            if (mask != 0) {
+                return p + __builtin_ctz(mask);
+            }
+            p += 16;
+        }
+    }
+#endif
+    for (; p < end; p++) {
+        if (_table[static_cast<unsigned char>(*p)]) {
+            return p;
+        }
+    }
+    return end;
+}
+
+void OutputFilter::addRedact(std::string_view literal) {
+    if ( ! literal.empty()) {
+        _redact_literals.emplace_back(literal);
+        _configure();
+    }
+}
+
+void OutputFilter::addRedactRegex(const std::string& regex) {
+    _redact_regexes.emplace_back(regex, boost::regex::ECMAScript);
+    _configure();
+}
+
+void OutputFilter::addDropLines(const std::string& regex) {
+    _drop_regexes.emplace_back(regex, boost::regex::ECMAScript);
+    _configure();
+}
+
+void OutputFilter::setStripEscapes(unsigned kinds) {
+    _strip = kinds & kStripAll;
+    _configure();
+}
+
+void OutputFilter::clear() {
+    _redact_literals.clear();
+    _redact_regexes.clear();
+    _drop_regexes.clear();
+    _strip = 0;
+    _configure();
+}
+
+void OutputFilter::_configure() {
+    _candidates.clear();
+    for (const auto& literal : _redact_literals) {
+        _candidates.add(literal[0]);
+    }
+    _stops.clear();
+    if (_line_rules()) {
+        _stops.add('\n');
+    }
+    if (_strip) {
+        _stops.add(kEsc);
+    }
+    _string_stops.clear();
+    _string_stops.add(kBel);
+    _string_stops.add(kEsc);
+}
+
+void OutputFilter::_emit(std::string_view s, std::string& out) {
+    if (_line_rules()) {
+        _line.append(s);
+        if (_line.size() >= kMaxLineLength) {
+            _flush_partial(true, out);
+        }
+    } else {
+        out.append(s);
+    }
+}
+
+void OutputFilter::feed(std::string_view chunk, std::string& out) {
+    if (_stops.empty() && _escape == Escape::NONE && _line.empty()) {
+        // nothing to do
+        out.append(chunk);
+        return;
+    }
+
+    auto p = chunk.data();
+    auto end = p + chunk.size();
+    while (p < end) {
+        if (_escape == Escape::STRING) {
+            // the body of a string sequence can be long, so skip through it in one go
+            auto stop = _string_stops.find(p, end);
+            if (_escape_keep) {
+                _emit(std::string_view(p, stop - p), out);
+            }
+            p = stop;
+            if (p == end) {
+                break;
+            }
+        }
+        if (_escape != Escape::NONE) {
+            if (_feed_escape(*p, out)) {
+                p++;
+            }
+            continue;
+        }
+
+        // plain text, up to whatever needs dealing with next
+        auto stop = _stops.find(p, end);
+        _emit(std::string_view(p, stop - p), out);
+        p = stop;
+        if (p == end) {
+            break;
+        }
+        if (*p == kEsc) {
+            _escape = Escape::ESC;
+            _escape_buf.assign(1, kEsc);
+        } else {
+            _line += '\n';
+            _end_line(true, out);
+        }
+        p++;
+    }
+}
+
+void OutputFilter::flushPartial(std::string& out) {
+    if ( ! _line.empty()) {
+        _flush_partial(false, out);
+    }
+}
+
+void OutputFilter::flush(std::string& out) {
+    if ( ! _line.empty()) {
+        _end_line(false, out);
+    }
+}
+
+bool OutputFilter::_feed_escape(char ch, std::string& out) {
+    switch (_escape) {
+    case Escape::ESC:
+        if (ch == '[') {
+            _escape_buf += ch;
+            _escape = Escape::CSI;
+        } else if (ch == ']' || ch == 'P' || ch == 'X' || ch == '^' || ch == '_') {
+            // the kind is already known, so there's no need to buffer the (possibly long) body
+            _escape_buf += ch;
+            _escape = Escape::STRING;
+            _escape_keep = ! (_strip & kStripOsc);
+            if (_escape_keep) {
+                _emit(_escape_buf, out);
+            }
+        } else if (in_range(ch, 0x20, 0x2f)) {
+            _escape_buf += ch;
+            _escape = Escape::INTERMEDIATE;
+        } else if (in_range(ch, 0x30, 0x7e)) {
+            _escape_buf += ch;
+            _end_escape(kStripOther, out);
+        } else {
+            _abort_escape(out);
+            return false;
+        }
+        return true;
+
+    case Escape::INTERMEDIATE:
+    case Escape::CSI: {
+        bool csi = (_escape == Escape::CSI);
+        if (in_range(ch, 0x20, csi ? 0x3f : 0x2f) && _escape_buf.size() < kMaxEscapeLength) {
+            _escape_buf += ch;
+        } else if (in_range(ch, csi ? 0x40 : 0x30, 0x7e)) {
+            _escape_buf += ch;
+            _end_escape((csi && ch == 'm') ? kStripSgr : kStripOther, out);
+        } else {
+            _abort_escape(out);
+            return false;
+        }
+        return true;
+    }
+
+    case Escape::STRING:
+        // (the body was dealt with by feed(), so this is the end of it)
+        if (ch == kBel) {
+            if (_escape_keep) {
+                _emit(std::string_view(&ch, 1), out);
+            }
+            _escape = Escape::NONE;
+        } else {
+            _escape = Escape::STRING_ESC;
+        }
+        return true;
+
+    case Escape::STRING_ESC:
+        if (ch == '\\') {
+            if (_escape_keep) {
+                _emit("\033\\", out);
+            }
+            _escape = Escape::NONE;
+            return true;
+        }
+        // the string was cut short by the start of another escape sequence
+        _escape = Escape::ESC;
+        _escape_buf.assign(1, kEsc);
+        return false;
+
+    case Escape::NONE:
+        break;
+    }
+    return false;
+}
+
+void OutputFilter::_end_escape(unsigned kind, std::string& out) {
+    if ( ! (_strip & kind)) {
+        _emit(_escape_buf, out);
+    }
+    _escape = Escape::NONE;
+}
+
+void OutputFilter::_abort_escape(std::string& out) {
+    // not a well formed escape sequence, so pass it on untouched
+    _emit(_escape_buf, out);
+    _escape = Escape::NONE;
+}
+
+void OutputFilter::_end_line(bool complete, std::string& out) {
+    // the rules are matched against the line without its line ending
+    std::string_view text(_line);
+    auto eol = text.find_last_not_of("\r\n") + 1;  // (npos + 1 is 0)
+    auto ending = text.substr(eol);
+    text = text.substr(0, eol);
+
+    if ( ! _line_started) {
+        _line_dropped = std::any_of(_drop_regexes.begin(), _drop_regexes.end(), [&text] (const boost::regex& regex) {
+            return boost::regex_search(text.begin(), text.end(), regex, kMatchFlags);
+        });
+    }
+    if ( ! _line_dropped) {
+        if (_redact_regexes.empty()) {
+            _redact(text, out);
+        } else {
+            std::string redacted(text);
+            for (const auto& regex : _redact_regexes) {
+                // most lines won't match, so don't build a new string for them
+                if (boost::regex_search(redacted, regex, kMatchFlags)) {
+                    redacted = boost::regex_replace(redacted, regex, kRedacted, kMatchFlags | boost::regex_constants::format_literal);
+                }
+            }
+            _redact(redacted, out);
+        }
+        out.append(ending);
+    }
+
+    _line.clear();
+    _line_started = ! complete;
+    if (complete) {
+        _line_dropped = false;
+    }
+}
+
+void OutputFilter::_flush_partial(bool forced, std::string& out) {
+    auto held = _held_back(_line);
+    if (forced && held > kMaxLineLength / 2) {
+        // (rather than hold back an endless line, which is most likely
+        // because of a regex like `.*`)
+        held = 0;
+    }
+    if (held == _line.size()) {
+        return;
+    }
+    auto rest = _line.substr(_line.size() - held);
+    _line.resize(_line.size() - held);
+    _end_line(false, out);
+    _line = std::move(rest);
+}
+
+size_t OutputFilter::_held_back(std::string_view text) const {
+    auto begin = text.data();
+    auto end = begin + text.size();
+    // (a partial match is one that more text might complete)
+    const boost::match_flag_type flags = kMatchFlags | boost::match_partial;
+
+    if ( ! _line_started) {
+        for (const auto& regex : _drop_regexes) {
+            boost::match_results<const char*> match;
+            if (boost::regex_search(begin, end, match, regex, flags) && ! match[0].matched) {
+                return text.size();
+            }
+        }
+    }
+
+    size_t keep = text.size();
+    for (const auto& regex : _redact_regexes) {
+        // Matches are redacted now, unless they reach the end of the text
+        // (when the rest of the line might make them longer).
+        auto p = begin;
+        boost::match_results<const char*> match;
+        while (p < end && boost::regex_search(p, end, match, regex, (p == begin) ? flags : (flags | boost::match_prev_avail))) {
+            if ( ! match[0].matched || match[0].second == end) {
+                keep = std::min<size_t>(keep, match[0].first - begin);
+                break;
+            }
+            p = std::max(match[0].second, p + 1);
+        }
+    }
+
+    auto shown = text.substr(0, keep);
+    for (const auto& literal : _redact_literals) {
+        for (auto len = std::min(literal.size() - 1, shown.size()); len > 0; len--) {
+            if (shown.ends_with(std::string_view(literal).substr(0, len))) {
+                keep = std::min(keep, shown.size() - len);
+                break;
+            }
+        }
+    }
+    return text.size() - keep;
+}
+
+void OutputFilter::_redact(std::string_view text, std::string& out) const {
+    if (_redact_literals.empty()) {
+        out.append(text);
+        return;
+    }
+    auto begin = text.data();
+    auto end = begin + text.size();
+    auto p = begin;
+    while (true) {
+        auto candidate = _candidates.find(p, end);
+        if (candidate == end) {
+            break;
+        }
+        std::string_view rest(candidate, end - candidate);
+        auto literal = std::find_if(_redact_literals.begin(), _redact_literals.end(), [&rest] (const std::string& literal) {
+            return rest.starts_with(literal);
+        });
+        if (literal == _redact_literals.end()) {
+            p = candidate + 1;
+            continue;
+        }
+        out.append(begin, candidate - begin);
+        out += kRedacted;
+        begin = p = candidate + literal->size();
+    }
+    out.append(begin, end - begin);
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/regex.hpp>
+
+// A set of bytes to stop at, when scanning through output for the next one
+// that needs attention.  With SSE2, 16 bytes are checked at a time (as long
+// as the set is small).
+class ByteSet {
+public:
+    static constexpr size_t kMaxSimdBytes = 8;
+
+    void add(unsigned char ch);
+    void clear();
+    bool empty() const { return _bytes.empty(); }
+    bool contains(unsigned char ch) const { return _table[ch]; }
+
+    // Returns the first byte in [begin, end) that is in the set (or end).
+    const char* find(const char* begin, const char* end) const;
+
+private:
+    std::array<bool, 256> _table = {};
+    std::vector<unsigned char> _bytes;
+};
+
+// Filters a stream of output (fed to it a chunk at a time, as it arrives)
+// before it is shown: redacting secrets, dropping whole lines, and stripping
+// escape sequences.
+//
+// Escape sequences and lines can be split over any number of chunks, so the
+// state of both is carried from one chunk to the next.  The redact and drop
+// rules work on whole lines, so while there are any, the end of the output
+// (the part of a line after the last newline) is held back until either the
+// rest of the line arrives, or it is flushed.  flushPartial() (eg. when the
+// output has been idle for a while, so that prompts and echoed keys still get
+// shown) only lets go of the part of the line that can't turn out to be part
+// of a secret, ie. it keeps back anything from the start of a redact regex
+// match that the rest of the line could still change, or the end of the line
+// if it is the start of a redact literal (or all of it, while a drop regex
+// could still match).  flush() lets go of everything.  The rest of a line
+// that was flushed part way through is still redacted, but it is only dropped
+// if the start of the line was.
+//
+// The regexes are ECMAScript, and (as with std::regex) `.` doesn't match a
+// line ending.
+class OutputFilter {
+public:
+    // What is shown in place of anything redacted.
+    static constexpr auto kRedacted = "********";
+    // Longest line that is held back (longer ones are flushed in pieces, with
+    // flushPartial(), unless that would still keep back half of it).
+    static constexpr size_t kMaxLineLength = 64 * 1024;
+
+    // Kinds of escape sequences which can be stripped.
+    static constexpr unsigned kStripSgr = 1;    // colours and text styles
+    static constexpr unsigned kStripOsc = 2;    // titles, hyperlinks, and other string sequences
+    static constexpr unsigned kStripOther = 4;  // everything else (eg. cursor movement)
+    static constexpr unsigned kStripAll = kStripSgr | kStripOsc | kStripOther;
+
+    void addRedact(std::string_view literal);
+    // These throw (a std::runtime_error) if the regex is invalid.
+    void addRedactRegex(const std::string& regex);
+    void addDropLines(const std::string& regex);
+    void setStripEscapes(unsigned kinds);
+    // Removes all of the rules (call flush() first, to not lose anything).
+    void clear();
+
+    // Filters the next chunk of output, appending the result to out.
+    void feed(std::string_view chunk, std::string& out);
+    // True if part of a line is being held back.
+    bool pending() const { return ! _line.empty(); }
+    // Filters and appends as much of what is being held back as can't be
+    // part of a secret (or of a line that might be dropped).
+    void flushPartial(std::string& out);
+    // Filters (as far as it can) and appends whatever is being held back.
+    void flush(std::string& out);
+
+private:
+    enum class Escape : uint8_t {
+        NONE,
+        ESC,
+        INTERMEDIATE,
+        CSI,
+        STRING,
+        STRING_ESC,
+    };
+
+    bool _line_rules() const {
+        return ! _redact_literals.empty() || ! _redact_regexes.empty() || ! _drop_regexes.empty();
+    }
+    void _configure();
+    void _emit(std::string_view s, std::string& out);
+    // Returns false if ch wasn't part of the escape sequence (and so still
+    // needs to be dealt with).
+    bool _feed_escape(char ch, std::string& out);
+    void _end_escape(unsigned kind, std::string& out);
+    void _abort_escape(std::string& out);
+    void _end_line(bool complete, std::string& out);
+    void _flush_partial(bool forced, std::string& out);
+    // How much of the end of text (the start of a line) has to be held back
+    // (see flushPartial).
+    size_t _held_back(std::string_view text) const;
+    void _redact(std::string_view text, std::string& out) const;
+
+    std::vector<std::string> _redact_literals;
+    // the first bytes of the literals
+    ByteSet _candidates;
+    std::vector<boost::regex> _redact_regexes;
+    std::vector<boost::regex> _drop_regexes;
+    unsigned _strip = 0;
+
+    // the bytes that end a run of plain text
+    ByteSet _stops;
+    // the bytes that end the body of a string sequence
+    ByteSet _string_stops;
+
+    Escape _escape = Escape::NONE;
+    // the escape sequence so far (unless it is a string sequence)
+    std::string _escape_buf;
+    // whether the current string sequence is being kept
+    bool _escape_keep = true;
+
+    std::string _line;
+    // part of the current line has already been flushed
+    bool _line_started = false;
+    // the current line is being dropped
+    bool _line_dropped = false;
+};
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <algorithm>
+#include <deque>
+
+#include "output_matcher.h"
+
+namespace {
+
+constexpr int32_t kNone = -1;
+
+}  // namespace
+
+void OutputMatcher::addLiteral(std::string_view literal) {
+    if ( ! literal.empty()) {
+        _literals.emplace_back(literal);
+        _built = false;
+    }
+}
+
+void OutputMatcher::addRegex(const std::string& regex) {
+    _regexes.emplace_back(regex, boost::regex::ECMAScript);
+    _regex_from.push_back(_window.size());
+}
+
+void OutputMatcher::_build() {
+    _nodes.assign(1, Node{});
+    _nodes[0].next.fill(kNone);
+    for (const auto& literal : _literals) {
+        int32_t node = 0;
+        for (unsigned char ch : literal) {
+            if (_nodes[node].next[ch] < 0) {
+                _nodes[node].next[ch] = _nodes.size();
+                _nodes.emplace_back();
+                _nodes.back().next.fill(kNone);
+            }
+            node = _nodes[node].next[ch];
+        }
+        _nodes[node].terminal = true;
+    }
+
+    // Turn the trie into a complete DFA: every missing transition goes
+    // wherever the fail link's transition goes, breadth first so that the
+    // fail links are always already done.
+    std::deque<int32_t> queue;
+    for (auto& next : _nodes[0].next) {
+        if (next < 0) {
+            next = 0;
+        } else {
+            _nodes[next].fail = 0;
+            queue.push_back(next);
+        }
+    }
+    while ( ! queue.empty()) {
+        auto node = queue.front();
+        queue.pop_front();
+        auto fail = _nodes[node].fail;
+        _nodes[node].terminal = _nodes[node].terminal || _nodes[fail].terminal;
+        for (int ch = 0; ch < 256; ch++) {
+            auto& next = _nodes[node].next[ch];
+            if (next < 0) {
+                next = _nodes[fail].next[ch];
+            } else {
+                _nodes[next].fail = _nodes[fail].next[ch];
+                queue.push_back(next);
+            }
+        }
+    }
+    _built = true;
+}
+
+bool OutputMatcher::feed(std::string_view chunk) {
+    if (_matched) {
+        return true;
+    }
+    if ( ! _built) {
+        _build();
+        _state = 0;
+    }
+
+    if ( ! _literals.empty()) {
+        auto state = _state;
+        for (unsigned char ch : chunk) {
+            state = _nodes[state].next[ch];
+            if (_nodes[state].terminal) {
+                _matched = true;
+                return true;
+            }
+        }
+        _state = state;
+    }
+
+    if ( ! _regexes.empty() && _feed_regexes(chunk)) {
+        _matched = true;
+    }
+    return _matched;
+}
+
+bool OutputMatcher::_feed_regexes(std::string_view chunk) {
+    // (like std::regex's ECMAScript, `.` doesn't match line endings; the
+    // earlier output is there for eg. ^ and \b to look back at)
+    const boost::match_flag_type search_flags = boost::match_default | boost::match_partial | boost::match_prev_avail | boost::match_not_dot_newline;
+
+    // Take at most kRegexWindow bytes of the chunk at a time, so that a flood
+    // of output costs the same per byte as a trickle.
+    while ( ! chunk.empty()) {
+        auto piece = chunk.substr(0, kRegexWindow);
+        chunk.remove_prefix(piece.size());
+        _window.append(piece);
+
+        const char* begin = _window.data();
+        auto end = begin + _window.size();
+        for (size_t i = 0; i < _regexes.size(); i++) {
+            boost::match_results<const char*> match;
+            // (match_prev_avail needs there to be something before the start)
+            boost::match_flag_type flags = (_regex_from[i] > 0) ? search_flags : (search_flags & ~boost::match_prev_avail);
+            if ( ! boost::regex_search(begin + _regex_from[i], end, match, _regexes[i], flags)) {
+                _regex_from[i] = _window.size();
+            } else if (match[0].matched) {
+                return true;
+            } else {
+                // a partial match, which the next output might complete
+                _regex_from[i] = match[0].first - begin;
+            }
+        }
+
+        // (trimmed in bulk, rather than moving the window along on every read)
+        if (_window.size() > 2 * kRegexWindow) {
+            auto excess = _window.size() - kRegexWindow;
+            _window.erase(0, excess);
+            for (auto& from : _regex_from) {
+                from = (from > excess) ? from - excess : 0;
+            }
+        }
+    }
+    return false;
+}
+
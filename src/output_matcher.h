@@ -0,0 +1,74 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/regex.hpp>
+
+// Watches a stream of output (fed to it a chunk at a time, as it arrives) for
+// any of a set of literal strings or regexes.
+//
+// The literals are all matched together, by a single Aho-Corasick automaton
+// which carries its state across chunks, so each byte costs one table lookup
+// no matter how many literals there are.  The regexes are searched for in a
+// bounded window of the most recent output (so a regex match can't be longer
+// than kRegexWindow bytes), using partial matching, so that each chunk only
+// searches the new output, plus whatever of the earlier output a match might
+// still be in progress from.
+class OutputMatcher {
+public:
+    static constexpr size_t kRegexWindow = 4096;
+
+    void addLiteral(std::string_view literal);
+    // Throws (a std::runtime_error) if the regex is invalid.
+    void addRegex(const std::string& regex);
+
+    // Scans the next chunk of output.  Returns true once anything has
+    // matched (and from then on, without scanning any more).
+    bool feed(std::string_view chunk);
+    bool matched() const { return _matched; }
+
+private:
+    struct Node {
+        std::array<int32_t, 256> next;
+        int32_t fail = 0;
+        bool terminal = false;
+    };
+
+    void _build();
+    bool _feed_regexes(std::string_view chunk);
+
+    std::vector<std::string> _literals;
+    std::vector<Node> _nodes;
+    bool _built = false;
+    int32_t _state = 0;
+
+    std::vector<boost::regex> _regexes;
+    std::string _window;
+    // For each regex, where in _window a match might still be in progress
+    // from (everything before that has already been searched).
+    std::vector<size_t> _regex_from;
+
+    bool _matched = false;
+};
+
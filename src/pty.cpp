@@ -0,0 +1,165 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+
+#include <boost/log/trivial.hpp>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "libgupty.h"
+#include "pty.h"
+
+extern char** environ;
+
+Pty::Pty(const std::string& name, const std::vector<std::string>& argv, const std::string& log_filename)
+: _name(name) {
+    runtime_assert( ! argv.empty(), "No command for pty " + name);
+    // (opened first, so that a problem with it doesn't leave a child behind)
+    if ( ! log_filename.empty()) {
+        openLog(log_filename);
+    }
+
+    _fd = posix_openpt(O_RDWR | O_NOCTTY);
+    runtime_assert(_fd >= 0, "There was a problem opening pty " + name);
+    runtime_assert(fcntl(_fd, F_SETFD, FD_CLOEXEC) == 0, "Could not set close-on-exec on pty " + name);
+    runtime_assert(fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_NONBLOCK) == 0, "Could not make pty non-blocking " + name);
+    runtime_assert(grantpt(_fd) == 0, "Could not grant access to pty " + name);
+    runtime_assert(unlockpt(_fd) == 0, "Could not unlock pty device " + name);
+    auto device_name = ptsname(_fd);
+    runtime_assert(device_name != nullptr, "Could not get pty device name " + name);
+    std::string device(device_name);
+    BOOST_LOG_TRIVIAL(debug) << "Opened pty " << _name << " (fd " << _fd << "): " << device;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+
+    // The child starts a new session before the file actions are done, so
+    // opening the pty device makes it the controlling terminal.
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, device.c_str(), O_RDWR, 0);
+    posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDERR_FILENO);
+
+    // (this is posix_spawn rather than fork, so that ptys can be started
+    // while other threads are running.)  The event loop blocks the signals
+    // it handles (eg. SIGCHLD), and the child must not inherit that.
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    for (auto signo : {SIGCHLD, SIGWINCH, SIGPIPE, SIGINT, SIGQUIT}) {
+        sigaddset(&defaults, signo);
+    }
+    posix_spawnattr_setsigmask(&attr, &empty);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    std::vector<char*> args;
+    std::transform(argv.begin(), argv.end(), std::back_inserter(args), raw_c_str);
+    args.push_back(nullptr);
+    auto result = posix_spawnp(&_pid, args[0], &actions, &attr, args.data(), environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (result != 0) {
+        close(_fd);
+        if (_log_fd >= 0) {
+            close(_log_fd);
+        }
+        throw std::runtime_error("Could not start " + argv[0] + " in pty " + name + ": " + strerror(result));
+    }
+    _running = true;
+    BOOST_LOG_TRIVIAL(debug) << "Started " << argv[0] << " in pty " << _name << " (pid " << _pid << ")";
+}
+
+Pty::~Pty() {
+    close(_fd);
+    if (_log_fd >= 0) {
+        close(_log_fd);
+    }
+    if (_running) {
+        // No need to check for failure - if the process has already gone away, then good.
+        kill(_pid, SIGKILL);
+        // (SIGKILL can't be caught, so this doesn't wait for long)
+        while (waitpid(_pid, nullptr, 0) < 0 && errno == EINTR) {
+        }
+    }
+}
+
+void Pty::resize(const winsize& window_size) {
+    auto result = ioctl(_fd, TIOCSWINSZ, &window_size);
+    // (this has been seen to fail on macos, for no obvious reason)
+    if (result != 0) {
+        BOOST_LOG_TRIVIAL(debug) << "Could not set window size of pty " << _name << ": " << strerror(errno);
+    }
+}
+
+void Pty::openLog(const std::string& log_filename) {
+    if (_log_fd >= 0) {
+        close(_log_fd);
+    }
+    _log_fd = open(log_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    errno_assert(_log_fd >= 0, "Could not open log file for pty " + _name);
+}
+
+void Pty::log(std::string_view data) {
+    while (_log_fd >= 0 && ! data.empty()) {
+        auto count = write(_log_fd, data.data(), data.size());
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            // carry on without the log, rather than stopping the demo
+            BOOST_LOG_TRIVIAL(error) << "Could not write to log file for pty " << _name << ": " << strerror(errno);
+            close(_log_fd);
+            _log_fd = -1;
+            break;
+        }
+        data.remove_prefix(count);
+    }
+}
+
+void Pty::reap() {
+    if ( ! _running) {
+        return;
+    }
+    int status = 0;
+    pid_t result;
+    do {
+        result = waitpid(_pid, &status, WNOHANG);
+    } while (result < 0 && errno == EINTR);
+    if (result == 0) {
+        return;
+    }
+    _running = false;
+    if (result > 0 && WIFEXITED(status)) {
+        BOOST_LOG_TRIVIAL(debug) << "Child in pty " << _name << " exited with status " << WEXITSTATUS(status);
+    } else if (result > 0 && WIFSIGNALED(status)) {
+        BOOST_LOG_TRIVIAL(debug) << "Child in pty " << _name << " was killed by signal " << WTERMSIG(status);
+    }
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+#include "ring_buffer.h"
+
+// A child process (normally a shell) running on a pseudoterminal of its own,
+// as the leader of a new session (so that the pty is its controlling
+// terminal, and eg. Ctrl-C typed into the pty interrupts it).  The pty fd is
+// non-blocking and close-on-exec.
+//
+// Nothing here reads or writes the pty: the owner watches fd() in its event
+// loop, and keeps what it needs to for each pty (eg. the input that is
+// waiting for the child to read it) here.
+class Pty {
+public:
+    // Starts argv (looked up in PATH, like execvp).  If log_filename is
+    // given, it is opened with openLog.
+    Pty(const std::string& name, const std::vector<std::string>& argv, const std::string& log_filename = "");
+    // Closes the pty, and kills the child (if it's still running).
+    ~Pty();
+
+    Pty(const Pty&) = delete;
+    Pty& operator=(const Pty&) = delete;
+
+    const std::string& name() const { return _name; }
+    int fd() const { return _fd; }
+    pid_t pid() const { return _pid; }
+
+    void resize(const winsize& window_size);
+
+    // Opens a file for the owner to append the pty's output to (see log).
+    void openLog(const std::string& log_filename);
+    bool logging() const { return _log_fd >= 0; }
+    // Appends output from the pty to the log file (if there is one).
+    void log(std::string_view data);
+
+    // Collects the child's exit status, if it has exited (the pty output can
+    // still be read after that, until closed is set).
+    void reap();
+
+    // Input for the pty, waiting for the child to read it.
+    RingBuffer input;
+    // What the event loop is currently watching the pty for.
+    uint32_t events = 0;
+    // Whether the child has asked for bracketed paste, and how much of
+    // CODE_BracketedPasteOn (or Off) has been seen so far.
+    bool bracketed_paste = false;
+    size_t bracketed_paste_matched = 0;
+    // Set once the child has closed its end of the pty (ie. exited).
+    bool closed = false;
+
+private:
+    std::string _name;
+    int _fd = -1;
+    pid_t _pid = -1;
+    bool _running = false;
+    int _log_fd = -1;
+};
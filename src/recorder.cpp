@@ -0,0 +1,280 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <boost/log/trivial.hpp>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libgupty.h"
+#include "recorder.h"
+
+namespace {
+
+// Enough for a good while of heavy output, without the writer keeping up.
+constexpr size_t kBufferSize = 256 * 1024;
+
+constexpr char kOutputEvent = 'o';
+constexpr char kResizeEvent = 'r';
+constexpr char kMarkerEvent = 'm';
+
+// Returns the length of the valid UTF-8 sequence at the start of s (or 0 if
+// it isn't one, eg. an overlong encoding or a surrogate).
+size_t valid_utf8_length(std::string_view s) {
+    unsigned char ch = s[0];
+    size_t len;
+    uint32_t min;
+    uint32_t cp;
+    if ((ch & 0xe0) == 0xc0) {
+        len = 2;
+        min = 0x80;
+        cp = ch & 0x1f;
+    } else if ((ch & 0xf0) == 0xe0) {
+        len = 3;
+        min = 0x800;
+        cp = ch & 0x0f;
+    } else if ((ch & 0xf8) == 0xf0) {
+        len = 4;
+        min = 0x10000;
+        cp = ch & 0x07;
+    } else {
+        return 0;
+    }
+    if (s.size() < len) {
+        return 0;
+    }
+    for (size_t i = 1; i < len; i++) {
+        unsigned char next = s[i];
+        if ((next & 0xc0) != 0x80) {
+            return 0;
+        }
+        cp = (cp << 6) | (next & 0x3f);
+    }
+    if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+        return 0;
+    }
+    return len;
+}
+
+// JSON strings have to be valid UTF-8, so anything in s that isn't is
+// written as U+FFFD (the replacement character).
+void append_json_string(std::string& out, std::string_view s) {
+    constexpr auto hex = "0123456789abcdef";
+    out += '"';
+    for (size_t i = 0; i < s.size(); i++) {
+        unsigned char ch = s[i];
+        if (ch >= 0x80) {
+            auto len = valid_utf8_length(s.substr(i));
+            if (len == 0) {
+                out += "\\ufffd";
+            } else {
+                out.append(s.data() + i, len);
+                i += len - 1;
+            }
+        } else if (ch == '"' || ch == '\\') {
+            out += '\\';
+            out += ch;
+        } else if (ch == '\n') {
+            out += "\\n";
+        } else if (ch == '\r') {
+            out += "\\r";
+        } else if (ch < 0x20 || ch == 0x7f) {
+            out += "\\u00";
+            out += hex[ch >> 4];
+            out += hex[ch & 0xf];
+        } else {
+            out += ch;
+        }
+    }
+    out += '"';
+}
+
+// Returns how many bytes at the end of s are the start of a UTF-8 sequence
+// which hasn't been completed yet.
+size_t incomplete_utf8_suffix(std::string_view s) {
+    for (size_t i = 1; i <= 3 && i <= s.size(); i++) {
+        unsigned char ch = s[s.size() - i];
+        if ((ch & 0xc0) == 0x80) {
+            continue;  // continuation byte, keep looking for the lead byte
+        }
+        size_t len = (ch & 0xe0) == 0xc0 ? 2 : (ch & 0xf0) == 0xe0 ? 3 : (ch & 0xf8) == 0xf0 ? 4 : 1;
+        return (len > i) ? i : 0;
+    }
+    return 0;
+}
+
+}  // namespace
+
+Recorder::Recorder(const std::string& filename, unsigned int width, unsigned int height)
+: _start(std::chrono::steady_clock::now()) {
+    _fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    runtime_assert(_fd >= 0, "Could not open recording file.");
+
+    std::string header = "{\"version\": 2, \"width\": " + std::to_string(width) + ", \"height\": " + std::to_string(height)
+        + ", \"timestamp\": " + std::to_string(std::time(nullptr)) + ", \"env\": {";
+    const char* sep = "";
+    for (auto name : {"SHELL", "TERM"}) {
+        if (auto value = getenv(name)) {
+            header += sep;
+            append_json_string(header, name);
+            header += ": ";
+            append_json_string(header, value);
+            sep = ", ";
+        }
+    }
+    header += "}}\n";
+    _write(header);
+
+    _pending.reserve(kBufferSize);
+    _events.reserve(kBufferSize);
+    _buf.reserve(kBufferSize);
+    _thread = std::thread([this] { _writer(); });
+}
+
+Recorder::~Recorder() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _cv.notify_one();
+    // the writer finishes off any pending events before it exits
+    _thread.join();
+    close(_fd);
+}
+
+void Recorder::output(std::string_view data) {
+    _record(kOutputEvent, data);
+}
+
+void Recorder::resize(unsigned int width, unsigned int height) {
+    _record(kResizeEvent, std::to_string(width) + "x" + std::to_string(height));
+}
+
+void Recorder::marker(std::string_view label) {
+    _record(kMarkerEvent, label);
+}
+
+void Recorder::_record(char type, std::string_view data) {
+    double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+    uint32_t len = data.size();
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _pending.append(reinterpret_cast<const char*>(&time), sizeof(time));
+        _pending += type;
+        _pending.append(reinterpret_cast<const char*>(&len), sizeof(len));
+        _pending.append(data);
+        // only bother the writer if it's waiting for something to do
+        wake = _writer_idle;
+        _writer_idle = false;
+    }
+    if (wake) {
+        _cv.notify_one();
+    }
+}
+
+void Recorder::_writer() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_pending.empty()) {
+                if (_stopping) {
+                    break;
+                }
+                _writer_idle = true;
+                _cv.wait(lock, [this] { return ! _pending.empty() || _stopping; });
+                continue;
+            }
+            // swap buffers, so that both keep their (preallocated) capacity
+            _events.clear();
+            _events.swap(_pending);
+        }
+
+        _encode(_events);
+        _write(_buf);
+    }
+
+    if ( ! _partial.empty()) {
+        // the recording ended partway through a character, so just let it go
+        BOOST_LOG_TRIVIAL(debug) << "Recording ended with an incomplete UTF-8 sequence.";
+    }
+}
+
+void Recorder::_encode(const std::string& events) {
+    _buf.clear();
+    size_t pos = 0;
+    while (pos < events.size()) {
+        double time;
+        uint32_t len;
+        std::memcpy(&time, events.data() + pos, sizeof(time));
+        pos += sizeof(time);
+        char type = events[pos++];
+        std::memcpy(&len, events.data() + pos, sizeof(len));
+        pos += sizeof(len);
+        std::string_view data(events.data() + pos, len);
+        pos += len;
+
+        std::string joined;
+        if (type == kOutputEvent) {
+            // JSON strings have to be valid UTF-8, so hold back the start of
+            // any character that was split across reads.
+            if ( ! _partial.empty()) {
+                joined = _partial;
+                joined.append(data);
+                data = joined;
+            }
+            auto suffix = incomplete_utf8_suffix(data);
+            _partial.assign(data.substr(data.size() - suffix));
+            data.remove_suffix(suffix);
+            if (data.empty()) {
+                continue;
+            }
+        }
+
+        char time_str[32];
+        auto time_len = snprintf(time_str, sizeof(time_str), "%.6f", time);
+        _buf += '[';
+        _buf.append(time_str, time_len);
+        _buf += ", \"";
+        _buf += type;
+        _buf += "\", ";
+        append_json_string(_buf, data);
+        _buf += "]\n";
+    }
+}
+
+void Recorder::_write(const std::string& s) {
+    size_t written = 0;
+    while (written < s.size()) {
+        auto count = write(_fd, s.data() + written, s.size() - written);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            BOOST_LOG_TRIVIAL(error) << "Could not write to recording file, errno " << errno;
+            return;
+        }
+        written += count;
+    }
+}
+
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+// Records what is shown to the audience as an asciicast v2 file (see
+// https://docs.asciinema.org/manual/asciicast/v2/), which can be played back
+// with `asciinema play` (or `gupty --replay`).
+//
+// Recording an event just timestamps it and copies its raw bytes into a
+// preallocated buffer; all of the JSON encoding and writing happens on a
+// background thread, so recording never waits on the filesystem.  (If the
+// writer falls a long way behind, the buffer grows rather than blocking.)
+class Recorder {
+public:
+    Recorder(const std::string& filename, unsigned int width, unsigned int height);
+    ~Recorder();
+
+    // Output shown to the audience.
+    void output(std::string_view data);
+    // The terminal changed size.
+    void resize(unsigned int width, unsigned int height);
+    // A point worth jumping to when playing back (eg. the start of a command).
+    void marker(std::string_view label);
+
+private:
+    void _record(char type, std::string_view data);
+    void _writer();
+    void _encode(const std::string& events);
+    void _write(const std::string& s);
+
+    int _fd = -1;
+    std::chrono::steady_clock::time_point _start;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    // Raw events, each one: time (double), type (char), length (uint32_t), bytes.
+    std::string _pending;
+    bool _writer_idle = false;
+    bool _stopping = false;
+
+    // only touched by the writer thread
+    std::string _events;
+    std::string _buf;
+    // The start of a UTF-8 sequence that was split across output events.
+    std::string _partial;
+
+    std::thread _thread;
+};
+
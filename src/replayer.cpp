@@ -0,0 +1,526 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <boost/log/trivial.hpp>
+
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+#include "libgupty.h"
+#include "replayer.h"
+
+namespace {
+
+// Bump this whenever the layout of the index file changes.
+constexpr auto kIndexMagic = "gupty-cast-index-1";
+
+constexpr auto CODE_clearscr = "\033[H\033[2J";
+
+constexpr char kOutputEvent = 'o';
+constexpr char kMarkerEvent = 'm';
+
+void skip_space(std::string_view& s) {
+    while ( ! s.empty() && (s[0] == ' ' || s[0] == '\t')) {
+        s.remove_prefix(1);
+    }
+}
+
+void append_utf8(std::string& out, uint32_t cp) {
+    if (cp < 0x80) {
+        out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+        out += static_cast<char>(0xc0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        out += static_cast<char>(0xe0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    } else {
+        out += static_cast<char>(0xf0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    }
+}
+
+bool parse_hex4(std::string_view& s, uint32_t& cp) {
+    if (s.size() < 4) {
+        return false;
+    }
+    auto result = std::from_chars(s.data(), s.data() + 4, cp, 16);
+    if (result.ptr != s.data() + 4) {
+        return false;
+    }
+    s.remove_prefix(4);
+    return true;
+}
+
+// Parses a JSON string (including the quotes) from the front of s.
+bool parse_json_string(std::string_view& s, std::string& out) {
+    if (s.empty() || s[0] != '"') {
+        return false;
+    }
+    s.remove_prefix(1);
+    out.clear();
+    while ( ! s.empty()) {
+        char ch = s[0];
+        s.remove_prefix(1);
+        if (ch == '"') {
+            return true;
+        }
+        if (ch != '\\') {
+            out += ch;
+            continue;
+        }
+        if (s.empty()) {
+            return false;
+        }
+        char esc = s[0];
+        s.remove_prefix(1);
+        switch (esc) {
+            case '"': out += '"'; break;
+            case '\\': out += '\\'; break;
+            case '/': out += '/'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                uint32_t cp;
+                if ( ! parse_hex4(s, cp)) {
+                    return false;
+                }
+                if (cp >= 0xd800 && cp < 0xdc00 && s.size() >= 2 && s[0] == '\\' && s[1] == 'u') {
+                    // surrogate pair
+                    s.remove_prefix(2);
+                    uint32_t low;
+                    if ( ! parse_hex4(s, low)) {
+                        return false;
+                    }
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                }
+                append_utf8(out, cp);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    return false;
+}
+
+bool is_keyframe(const CastEvent& event) {
+    return event.type == kOutputEvent
+        && (event.data.find("\033[2J") != std::string::npos || event.data.find("\033c") != std::string::npos);
+}
+
+// Markers written by gupty are labelled "<command number>: <command>".
+int32_t marker_command(const CastEvent& event) {
+    int32_t command = -1;
+    auto result = std::from_chars(event.data.data(), event.data.data() + event.data.size(), command);
+    if (result.ec != std::errc() || result.ptr == event.data.data() + event.data.size() || *result.ptr != ':') {
+        return -1;
+    }
+    return command;
+}
+
+template <typename T>
+void write_raw(std::ostream& out, const T& t) {
+    out.write(reinterpret_cast<const char*>(&t), sizeof(t));
+}
+
+template <typename T>
+void read_raw(std::istream& in, T& t) {
+    in.read(reinterpret_cast<char*>(&t), sizeof(t));
+}
+
+void write_all(int fd, std::string_view s) {
+    while ( ! s.empty()) {
+        auto count = write(fd, s.data(), s.size());
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        runtime_assert(count > 0, "Could not write to stdout.");
+        s.remove_prefix(count);
+    }
+}
+
+}  // namespace
+
+std::optional<CastEvent> parseCastEvent(std::string_view line) {
+    CastEvent event;
+    skip_space(line);
+    if (line.empty() || line[0] != '[') {
+        return std::nullopt;
+    }
+    line.remove_prefix(1);
+    skip_space(line);
+
+    // (strtod needs a terminated string, and floating point from_chars isn't
+    // available everywhere)
+    char number[32];
+    size_t len = 0;
+    while (len < line.size() && len < sizeof(number) - 1 && std::strchr("0123456789+-.eE", line[len]) && line[len] != '\0') {
+        number[len] = line[len];
+        len++;
+    }
+    number[len] = '\0';
+    char* end = nullptr;
+    event.time = std::strtod(number, &end);
+    if (len == 0 || end != number + len) {
+        return std::nullopt;
+    }
+    line.remove_prefix(len);
+    skip_space(line);
+    if (line.empty() || line[0] != ',') {
+        return std::nullopt;
+    }
+    line.remove_prefix(1);
+    skip_space(line);
+
+    std::string type;
+    if ( ! parse_json_string(line, type) || type.size() != 1) {
+        return std::nullopt;
+    }
+    event.type = type[0];
+    skip_space(line);
+    if (line.empty() || line[0] != ',') {
+        return std::nullopt;
+    }
+    line.remove_prefix(1);
+    skip_space(line);
+
+    if ( ! parse_json_string(line, event.data)) {
+        return std::nullopt;
+    }
+    return event;
+}
+
+
+CastIndex::CastIndex(const std::string& cast_filename) {
+    struct stat st;
+    runtime_assert(stat(cast_filename.c_str(), &st) == 0, "Could not open recording: " + cast_filename);
+    uint64_t cast_size = st.st_size;
+#ifdef __APPLE__
+    const auto& mtim = st.st_mtimespec;
+#else
+    const auto& mtim = st.st_mtim;
+#endif
+    int64_t cast_mtime = static_cast<int64_t>(mtim.tv_sec) * 1000000000 + mtim.tv_nsec;
+
+    auto index_filename = cast_filename + ".idx";
+    if ( ! _read(index_filename, cast_size, cast_mtime)) {
+        BOOST_LOG_TRIVIAL(debug) << "Building seek index: " << index_filename;
+        _build(cast_filename);
+        _write(index_filename, cast_size, cast_mtime);
+    }
+    _collate();
+}
+
+bool CastIndex::_read(const std::string& index_filename, uint64_t cast_size, int64_t cast_mtime) {
+    std::ifstream in(index_filename, std::ios::binary);
+    std::string magic(std::strlen(kIndexMagic), '\0');
+    in.read(magic.data(), magic.size());
+    if ( ! in || magic != kIndexMagic) {
+        return false;
+    }
+
+    uint64_t size;
+    int64_t mtime;
+    uint64_t count;
+    read_raw(in, size);
+    read_raw(in, mtime);
+    read_raw(in, count);
+    if ( ! in || size != cast_size || mtime != cast_mtime || count > cast_size) {
+        BOOST_LOG_TRIVIAL(debug) << "Seek index is stale: " << index_filename;
+        return false;
+    }
+
+    _entries.resize(count);
+    for (auto& entry : _entries) {
+        read_raw(in, entry.time);
+        read_raw(in, entry.offset);
+        read_raw(in, entry.type);
+        read_raw(in, entry.keyframe);
+        read_raw(in, entry.command);
+    }
+    if ( ! in) {
+        _entries.clear();
+        return false;
+    }
+    return true;
+}
+
+void CastIndex::_build(const std::string& cast_filename) {
+    std::ifstream in(cast_filename, std::ios::binary);
+    std::string line;
+    // the first line is the header
+    std::getline(in, line);
+    uint64_t offset = line.size() + 1;
+
+    while (std::getline(in, line)) {
+        if (auto event = parseCastEvent(line)) {
+            _entries.push_back({event->time, offset, event->type, is_keyframe(*event),
+                                event->type == kMarkerEvent ? marker_command(*event) : -1});
+        }
+        offset += line.size() + 1;
+    }
+}
+
+void CastIndex::_write(const std::string& index_filename, uint64_t cast_size, int64_t cast_mtime) const {
+    // write to a temporary file and then rename it into place, so that a
+    // concurrent reader never sees a partial index.
+    auto tmp_filename = index_filename + ".tmp";
+    {
+        std::ofstream out(tmp_filename, std::ios::binary | std::ios::trunc);
+        if ( ! out) {
+            BOOST_LOG_TRIVIAL(error) << "Could not write seek index: " << index_filename;
+            return;
+        }
+        out.write(kIndexMagic, std::strlen(kIndexMagic));
+        write_raw(out, cast_size);
+        write_raw(out, cast_mtime);
+        write_raw(out, static_cast<uint64_t>(_entries.size()));
+        for (const auto& entry : _entries) {
+            write_raw(out, entry.time);
+            write_raw(out, entry.offset);
+            write_raw(out, entry.type);
+            write_raw(out, entry.keyframe);
+            write_raw(out, entry.command);
+        }
+    }
+    std::rename(tmp_filename.c_str(), index_filename.c_str());
+}
+
+void CastIndex::_collate() {
+    for (size_t i = 0; i < _entries.size(); i++) {
+        if (_entries[i].keyframe) {
+            _keyframes.push_back(i);
+        }
+        if (_entries[i].command >= 0) {
+            _markers.push_back(i);
+        }
+    }
+}
+
+size_t CastIndex::findTime(double time) const {
+    return std::lower_bound(_entries.begin(), _entries.end(), time, [] (const Entry& entry, double time) {
+        return entry.time < time;
+    }) - _entries.begin();
+}
+
+size_t CastIndex::findCommand(int32_t command) const {
+    // commands are run in order, so the markers are sorted by command too
+    auto it = std::lower_bound(_markers.begin(), _markers.end(), command, [this] (size_t i, int32_t command) {
+        return _entries[i].command < command;
+    });
+    return (it == _markers.end()) ? _entries.size() : *it;
+}
+
+size_t CastIndex::markerBefore(size_t i) const {
+    auto it = std::lower_bound(_markers.begin(), _markers.end(), i);
+    return (it == _markers.begin()) ? _entries.size() : *(it - 1);
+}
+
+size_t CastIndex::keyframeBefore(size_t i) const {
+    auto it = std::upper_bound(_keyframes.begin(), _keyframes.end(), i);
+    return (it == _keyframes.begin()) ? 0 : *(it - 1);
+}
+
+
+Replayer::Replayer(const std::string& filename)
+: _filename(filename), _in(filename, std::ios::binary), _index(filename) {
+    runtime_assert(_in.good(), "Could not open recording: " + filename);
+    std::string header;
+    std::getline(_in, header);
+    runtime_assert(header.find("\"version\": 2") != std::string::npos || header.find("\"version\":2") != std::string::npos,
+                   "Not an asciicast v2 recording: " + filename);
+}
+
+void Replayer::setSpeed(double speed) {
+    runtime_assert(speed > 0, "Replay speed must be positive.");
+    _speed = speed;
+}
+
+void Replayer::seekTime(double time) {
+    _start_at = _index.findTime(time);
+}
+
+void Replayer::seekCommand(int32_t command) {
+    _start_at = _index.findCommand(command);
+}
+
+void Replayer::_seek(size_t i) {
+    const auto& entries = _index.entries();
+    i = std::min(i, entries.size());
+
+    // the screen can only be reconstructed by replaying the output since it
+    // was last cleared, so do that all in one go.
+    std::string output = CODE_clearscr;
+    for (auto j = _index.keyframeBefore(i); j < i; j++) {
+        if (entries[j].type == kOutputEvent) {
+            if (auto event = _read_event(j)) {
+                output += event->data;
+            }
+        }
+    }
+    write_all(STDOUT_FILENO, output);
+
+    _next = i;
+    _start_time = (i < entries.size()) ? entries[i].time : 0;
+    _start_clock = Clock::now();
+}
+
+std::optional<CastEvent> Replayer::_read_event(size_t i) {
+    if (i != _stream_next) {
+        // only seek when jumping around, so that playing in order can just
+        // read through the (buffered) file.
+        _in.clear();
+        _in.seekg(_index.entries()[i].offset);
+    }
+    std::string line;
+    while (std::getline(_in, line)) {
+        // (lines which aren't events were left out of the index)
+        if (auto event = parseCastEvent(line)) {
+            _stream_next = i + 1;
+            return event;
+        }
+    }
+    _stream_next = SIZE_MAX;
+    return std::nullopt;
+}
+
+void Replayer::_restart_clock() {
+    const auto& entries = _index.entries();
+    _start_time = (_next > 0) ? entries[_next - 1].time : 0;
+    _start_clock = Clock::now();
+}
+
+void Replayer::_play(const CastEvent& event) {
+    if (event.type == kOutputEvent) {
+        write_all(STDOUT_FILENO, event.data);
+    } else if (event.type == kMarkerEvent) {
+        BOOST_LOG_TRIVIAL(debug) << "Replaying command " << event.data;
+    }
+    // anything else (eg. resizes) can't be applied to our own terminal
+}
+
+bool Replayer::_handle_key(char key) {
+    const auto& entries = _index.entries();
+    if (key == 'q' || key == '\003') {
+        return false;
+
+    } else if (key == ' ') {
+        _paused = ! _paused;
+        _restart_clock();
+
+    } else if (key == '.' && _paused && _next < entries.size()) {
+        if (auto event = _read_event(_next)) {
+            _play(*event);
+        }
+        _next++;
+
+    } else if (key == '+') {
+        _speed *= 2;
+        _restart_clock();
+
+    } else if (key == '-') {
+        _speed /= 2;
+        _restart_clock();
+
+    } else if (key == ']' || key == '[') {
+        // find the command currently being played (ie. the last marker so far)
+        auto marker = _index.markerBefore(_next);
+        int32_t current = (marker < entries.size()) ? entries[marker].command : 0;
+        auto target = (key == ']') ? current + 1 : std::max(current - 1, 0);
+        _seek(target > 0 ? _index.findCommand(target) : 0);
+    }
+    return true;
+}
+
+void Replayer::run() {
+    // keys need to be seen as they are pressed
+    termios orig_settings;
+    bool is_tty = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &orig_settings) == 0;
+    if (is_tty) {
+        // (this also turns off output processing, which was off when recording too)
+        termios settings = orig_settings;
+        cfmakeraw(&settings);
+        tcsetattr(STDIN_FILENO, TCSANOW, &settings);
+    }
+
+    bool playing = true;
+    EventLoop loop;
+    loop.watchFd(STDIN_FILENO, EventLoop::READABLE, [&] (uint32_t) {
+        char buffer[64];
+        auto count = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if (count <= 0) {
+            loop.unwatchFd(STDIN_FILENO);
+            return;
+        }
+        for (ssize_t i = 0; i < count && playing; i++) {
+            playing = _handle_key(buffer[i]);
+        }
+    });
+
+    try {
+        const auto& entries = _index.entries();
+        if (_start_at) {
+            _seek(*_start_at);
+        }
+        _restart_clock();
+        while (playing && _next < entries.size()) {
+            if (_paused) {
+                loop.runOnce(-1);
+                continue;
+            }
+            auto due = _start_clock + std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>((entries[_next].time - _start_time) / _speed));
+            auto remaining = std::chrono::ceil<std::chrono::milliseconds>(due - Clock::now());
+            if (remaining.count() > 0) {
+                loop.runOnce(remaining.count());
+                continue;
+            }
+            // poll for keys without waiting, so that even a flood of events can be paused
+            loop.runOnce(0);
+            if (playing && ! _paused) {
+                if (auto event = _read_event(_next)) {
+                    _play(*event);
+                }
+                _next++;
+            }
+        }
+    } catch (...) {
+        if (is_tty) {
+            tcsetattr(STDIN_FILENO, TCSANOW, &orig_settings);
+        }
+        throw;
+    }
+    if (is_tty) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &orig_settings);
+    }
+}
+
@@ -0,0 +1,123 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// One event from an asciicast v2 file: [time, type, data].
+struct CastEvent {
+    double time = 0;
+    char type = 0;
+    std::string data;
+};
+
+// Parses an event line.  Returns nullopt if it isn't a valid event.
+std::optional<CastEvent> parseCastEvent(std::string_view line);
+
+
+// Where every event in an asciicast file is, so that playback can jump
+// straight to any time or script command (with a binary search) instead of
+// reading through the whole file.
+//
+// The index is kept in a sidecar file (<file.cast>.idx), which is rebuilt
+// whenever it is missing, or older than the recording.
+class CastIndex {
+public:
+    struct Entry {
+        double time;
+        uint64_t offset;     // of the event's line in the cast file
+        char type;
+        bool keyframe;       // output which clears the screen (so nothing before it matters)
+        int32_t command;     // for markers, the (1-based) script command number, otherwise -1
+    };
+
+    explicit CastIndex(const std::string& cast_filename);
+
+    const std::vector<Entry>& entries() const { return _entries; }
+
+    // The first event at or after the given time.
+    size_t findTime(double time) const;
+    // The marker for the given script command (or the first one after it),
+    // or entries().size() if there is none.
+    size_t findCommand(int32_t command) const;
+    // The last marker before the given event, or entries().size() if there isn't one.
+    size_t markerBefore(size_t i) const;
+    // The latest keyframe at or before the given event (or 0 if there isn't one).
+    size_t keyframeBefore(size_t i) const;
+
+private:
+    bool _read(const std::string& index_filename, uint64_t cast_size, int64_t cast_mtime);
+    void _build(const std::string& cast_filename);
+    void _write(const std::string& index_filename, uint64_t cast_size, int64_t cast_mtime) const;
+    void _collate();
+
+    std::vector<Entry> _entries;
+    std::vector<size_t> _keyframes;
+    std::vector<size_t> _markers;
+};
+
+
+// Plays back an asciicast recording to stdout, in real time (or faster or
+// slower).  While playing, these keys are available:
+//   <space>  pause / resume
+//   .        (when paused) show the next event
+//   + -      double / halve the speed
+//   ] [      jump to the next / previous script command
+//   q        quit (as does <ctrl-c>)
+class Replayer {
+public:
+    explicit Replayer(const std::string& filename);
+
+    void setSpeed(double speed);
+    // Where to start playing from.
+    void seekTime(double time);
+    void seekCommand(int32_t command);
+
+    void run();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    void _seek(size_t i);
+    std::optional<CastEvent> _read_event(size_t i);
+    void _play(const CastEvent& event);
+    bool _handle_key(char key);
+    void _restart_clock();
+
+    std::string _filename;
+    std::ifstream _in;
+    CastIndex _index;
+    // The event that the next read from _in will get.
+    size_t _stream_next = 0;
+
+    std::optional<size_t> _start_at;
+    size_t _next = 0;
+    double _speed = 1.0;
+    bool _paused = false;
+
+    // The recording time at which playback (re)started, and when that was.
+    double _start_time = 0;
+    Clock::time_point _start_clock;
+};
+
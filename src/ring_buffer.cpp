@@ -0,0 +1,176 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "ring_buffer.h"
+
+namespace {
+
+// How many consecutive "light" reads (using less than 1/8th of the capacity)
+// before the buffer is shrunk.
+constexpr unsigned int kShrinkAfterLightReads = 256;
+
+}  // namespace
+
+RingBuffer::RingBuffer(size_t min_capacity, size_t max_capacity)
+: _buf(min_capacity), _min_capacity(min_capacity), _max_capacity(std::max(min_capacity, max_capacity))
+{ }
+
+int RingBuffer::data(iovec (&iov)[2]) const {
+    if (_size == 0) {
+        return 0;
+    }
+    auto cap = _buf.size();
+    auto first = std::min(_size, cap - _head);
+    iov[0].iov_base = const_cast<char*>(_buf.data()) + _head;
+    iov[0].iov_len = first;
+    if (first == _size) {
+        return 1;
+    }
+    iov[1].iov_base = const_cast<char*>(_buf.data());
+    iov[1].iov_len = _size - first;
+    return 2;
+}
+
+int RingBuffer::_free(iovec (&iov)[2]) const {
+    auto cap = _buf.size();
+    if (_size == cap) {
+        return 0;
+    }
+    auto tail = (_head + _size) % cap;
+    auto free = cap - _size;
+    auto first = std::min(free, cap - tail);
+    iov[0].iov_base = const_cast<char*>(_buf.data()) + tail;
+    iov[0].iov_len = first;
+    if (first == free) {
+        return 1;
+    }
+    iov[1].iov_base = const_cast<char*>(_buf.data());
+    iov[1].iov_len = free - first;
+    return 2;
+}
+
+void RingBuffer::_resize(size_t new_capacity) {
+    // Linearise the buffered data at the start of the new storage.
+    std::vector<char> buf(new_capacity);
+    iovec iov[2];
+    auto n = data(iov);
+    size_t off = 0;
+    for (int i = 0; i < n; i++) {
+        std::memcpy(buf.data() + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+    _buf.swap(buf);
+    _head = 0;
+}
+
+ssize_t RingBuffer::readFrom(int fd) {
+    if (available() == 0 && _buf.size() < _max_capacity) {
+        _resize(std::min(_buf.size() * 2, _max_capacity));
+    }
+
+    iovec iov[2];
+    auto n = _free(iov);
+    if (n == 0) {
+        return 0;
+    }
+    auto free = available();
+
+    ssize_t count;
+    do {
+        count = readv(fd, iov, n);
+    } while (count < 0 && errno == EINTR);
+
+    if (count > 0) {
+        _size += count;
+
+        if (static_cast<size_t>(count) == free && _buf.size() < _max_capacity) {
+            // The read filled everything we had, so there is probably more
+            // waiting.  Make room for it now, rather than on the next read.
+            _resize(std::min(_buf.size() * 2, _max_capacity));
+            _light_reads = 0;
+
+        } else if (static_cast<size_t>(count) < _buf.size() / 8) {
+            _light_reads++;
+
+        } else {
+            _light_reads = 0;
+        }
+    }
+    return count;
+}
+
+ssize_t RingBuffer::writeTo(int fd) {
+    iovec iov[2];
+    auto n = data(iov);
+    if (n == 0) {
+        return 0;
+    }
+
+    ssize_t count;
+    do {
+        count = writev(fd, iov, n);
+    } while (count < 0 && errno == EINTR);
+
+    if (count > 0) {
+        consume(count);
+    }
+    return count;
+}
+
+void RingBuffer::append(const char* data, size_t len) {
+    if (len > available()) {
+        auto cap = std::max<size_t>(_buf.size(), 1);
+        while (cap - _size < len) {
+            cap *= 2;
+        }
+        _resize(cap);
+    }
+
+    iovec iov[2];
+    auto n = _free(iov);
+    size_t off = 0;
+    for (int i = 0; i < n && off < len; i++) {
+        auto chunk = std::min(len - off, iov[i].iov_len);
+        std::memcpy(iov[i].iov_base, data + off, chunk);
+        off += chunk;
+    }
+    _size += len;
+}
+
+void RingBuffer::consume(size_t n) {
+    n = std::min(n, _size);
+    _size -= n;
+    if (_size == 0) {
+        _head = 0;
+        if (_light_reads >= kShrinkAfterLightReads && _buf.size() > _min_capacity) {
+            _resize(std::max(_buf.size() / 2, _min_capacity));
+            _light_reads = 0;
+        }
+    } else {
+        _head = (_head + n) % _buf.size();
+    }
+}
+
+void RingBuffer::clear() {
+    consume(_size);
+}
+
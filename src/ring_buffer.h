@@ -0,0 +1,76 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// A reusable byte ring buffer, intended for shuffling bytes between fds
+// without intermediate copies.  Reads and writes are done with readv(2) and
+// writev(2) directly on the (up to two) contiguous regions of the ring.
+//
+// The capacity adapts to the load: it doubles (up to max_capacity) whenever a
+// read fills all of the free space, and halves (down to min_capacity) after a
+// long run of reads that only used a small fraction of it.
+class RingBuffer {
+public:
+    explicit RingBuffer(size_t min_capacity = 4096, size_t max_capacity = 1024 * 1024);
+
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+    size_t capacity() const { return _buf.size(); }
+    size_t available() const { return _buf.size() - _size; }
+
+    // True if the buffer is full and is not allowed to grow any further.
+    bool saturated() const { return available() == 0 && _buf.size() >= _max_capacity; }
+
+    // Does a single readv(2) from fd into the free space, growing the buffer
+    // first if it is full (and allowed to grow).  Returns the result of readv(2).
+    ssize_t readFrom(int fd);
+
+    // Does a single writev(2) of the buffered data to fd, and consumes whatever
+    // was written.  Returns the result of writev(2).
+    ssize_t writeTo(int fd);
+
+    // Fills iov with the contiguous regions of buffered data (oldest first),
+    // and returns how many of them there are (0, 1 or 2).
+    int data(iovec (&iov)[2]) const;
+
+    // Copies len bytes into the buffer, growing it as needed (ignoring max_capacity).
+    void append(const char* data, size_t len);
+
+    // Discards the oldest n buffered bytes.
+    void consume(size_t n);
+
+    void clear();
+
+private:
+    int _free(iovec (&iov)[2]) const;
+    void _resize(size_t new_capacity);
+
+    std::vector<char> _buf;
+    size_t _head = 0;  // offset of the oldest buffered byte
+    size_t _size = 0;  // number of buffered bytes
+
+    size_t _min_capacity;
+    size_t _max_capacity;
+    unsigned int _light_reads = 0;
+};
+
@@ -15,14 +15,15 @@
 */
 
 #include <algorithm>
+#include <iomanip>
 #include <iostream>
 #include <iterator>
 #include <sstream>
 #include <string>
 
+#include <boost/algorithm/string/case_conv.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/log/trivial.hpp>
-#include <boost/process.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/property_tree/ptree.hpp>
 
@@ -30,44 +31,13 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/ioctl.h>
 #include <sys/poll.h>
 #include <sys/wait.h>
 
 #include "keycodes.h"
 #include "session.h"
 
-constexpr auto CMD_NOTE = "note";
-constexpr auto CMD_SKIP = "skip";
-constexpr auto CMD_RESUME = "resume";
-constexpr auto CMD_SET_MODE = "set_mode";
-constexpr auto CMD_PAUSE = "pause";
-constexpr auto CMD_OUTPUT = "output";
-constexpr auto CMD_EXIT = "exit";
-constexpr auto CMD_RUN = "run";
-
-constexpr auto CMD_WAIT_FOR_ANY_KEY = "wait_for_any_key";
-constexpr auto CMD_PASTE_KEYS = "paste_keys";
-constexpr auto CMD_PASTE_KEY = "paste_key";
-constexpr auto CMD_TYPE_KEYS = "type_keys";
-constexpr auto CMD_TYPE_KEY = "type_key";
-constexpr auto CMD_WAIT_FOR_ENTER = "wait_for_enter";
-constexpr auto CMD_WAIT_FOR_AND_SEND_ENTER = "wait_for_and_send_enter";
-constexpr auto CMD_PASTE = "paste";
-constexpr auto CMD_PASTE_LINE = "paste_line";
-constexpr auto CMD_TYPE_LINE = "type_line";
-constexpr auto CMD_TYPE = "type";
-
-// FIXME: these should go away in favour of UserInputModeNames
-constexpr auto MODE_INSERT = "insert";
-constexpr auto MODE_COMMAND = "command";
-constexpr auto MODE_PASSTHROUGH = "passthrough";
-constexpr auto MODE_AUTO = "auto";
-
-// FIXME: these should go away in favour of OutputModeNames
-constexpr auto OUTPUT_ALL = "all";
-constexpr auto OUTPUT_NONE = "none";
-
-
 Enum<Session::UserInputMode> Session::UserInputModeNames({
     {"COMMAND", UserInputMode::COMMAND},
     {"INSERT", UserInputMode::INSERT},
@@ -94,140 +64,242 @@ Enum<Session::AutoPilotMode> Session::AutoPilotModeNames({
     {"FULL", AutoPilotMode::FULL},
 }, "UNKNOWN", AutoPilotMode::UNKNOWN);
 
+Enum<Session::BracketedPasteMode> Session::BracketedPasteModeNames({
+    {"OFF", BracketedPasteMode::OFF},
+    {"ON", BracketedPasteMode::ON},
+    {"AUTO", BracketedPasteMode::AUTO},
+}, "UNKNOWN", BracketedPasteMode::UNKNOWN);
+
+
+// How long the window size has to stay the same before it is passed on to the child.
+constexpr auto kResizeDebounce = std::chrono::milliseconds(50);
+
+// How long the output has to be idle before the output filter gives up
+// waiting for the rest of a line, and shows what it safely can of it.
+constexpr auto kFilterFlushDelay = std::chrono::milliseconds(20);
+
+// The most pty reads done for each wakeup when output is written in frames,
+// so that stdin (which is a priority fd for the event loop) is never kept
+// waiting for long, however fast the child writes.
+constexpr int kMaxFrameReads = 16;
+// The frame limit has to leave room in _pty_output for the next read.
+constexpr size_t kMaxFrameLimit = 512 * 1024;
+
+// How much input can be queued up for the pty before sending any more waits
+// for the child to read some of it.
+constexpr size_t kMaxPtyInput = 1024 * 1024;
+
+// How far the autopilot's speed can be turned up or down (from 1x).
+constexpr double kMaxAutoSpeed = 16.0;
+// People pause a little between words.
+constexpr double kAutoWordPause = 1.5;
+
+// How often (at most) the checkpoint is saved.
+constexpr auto kCheckpointInterval = std::chrono::seconds(1);
+
+// `run` is just a job that is waited for straight away.
+constexpr auto kRunJobName = "run";
+
+// The pty started by init (for the shell), which is there from the start.
+constexpr auto kMainPtyName = "main";
+
+// Limits on what a script can expand to, so that a mistake (eg. a macro which
+// calls itself) is reported, rather than using up all the memory.
+constexpr int64_t kMaxRepeatCount = 100000;
+constexpr size_t kMaxNesting = 64;
+constexpr size_t kMaxExpandedCommands = 1000000;
+
+namespace {
+
+// Names of variables, macros and macro parameters.
+bool is_variable_name(std::string_view s) {
+    return ! s.empty() && ! std::isdigit(static_cast<unsigned char>(s[0]))
+        && std::all_of(s.begin(), s.end(), [] (char ch) { return std::isalnum(static_cast<unsigned char>(ch)) || ch == '_'; });
+}
+
+// Names of jobs and ptys, which end up in log filenames (so are kept simple).
+bool is_simple_name(std::string_view s) {
+    return ! s.empty() && std::all_of(s.begin(), s.end(), [] (char ch) {
+        return std::isalnum(static_cast<unsigned char>(ch)) || ch == '_' || ch == '-' || ch == '.';
+    });
+}
+
+}  // namespace
+
 
 Session::Session()
 : _commandFns{
     // These command lambdas all use `[&]` to capture the `this` pointer.
 
-    {CMD_NOTE, [&] (const Command& cmd) {
+    {Op::NOTE, [&] (const Command&) {
         // deliberately empty
     }},
 
-    {CMD_SKIP, [&] (const Command& cmd) {
-        _skipping = true;
+    {Op::SKIP, [&] (const Command& cmd) {
+        // (where to carry on from was worked out when the script was loaded)
+        _seek(cmd.value);
+    }},
+
+    {Op::RESUME, [&] (const Command&) {
+        // deliberately empty (see SKIP)
+    }},
+
+    {Op::LABEL, [&] (const Command&) {
+        // deliberately empty (labels are only for seeking to)
     }},
 
-    {CMD_RESUME, [&] (const Command& cmd) {
-        _skipping = false;
+    {Op::SET_MODE, [&] (const Command& cmd) {
+        _input_mode = static_cast<UserInputMode>(cmd.value);
     }},
 
-    {CMD_SET_MODE, [&] (const Command& cmd) {
-        // FIXME: use UserInputModeNames
-        if (cmd.arg == MODE_PASSTHROUGH) {
-            _input_mode = UserInputMode::PASSTHROUGH;
+    {Op::PAUSE, [&] (const Command& cmd) {
+        // keep relaying output (and watching for eg. Ctrl-C) while pausing
+        _wait_until(std::chrono::steady_clock::now() + std::chrono::milliseconds(cmd.value), [] { return false; });
+    }},
 
-        } else if (cmd.arg == MODE_INSERT) {
-            _input_mode = UserInputMode::INSERT;
+    {Op::OUTPUT, [&] (const Command& cmd) {
+        if (_output_mode == OutputMode::FILTERED) {
+            _flush_output_filter();
+        }
+        _output_mode = static_cast<OutputMode>(cmd.value);
+    }},
 
-        } else if (cmd.arg == MODE_AUTO) {
-            _input_mode = UserInputMode::AUTO;
+    {Op::EXIT, [&] (const Command&) {
+        // let the children have the rest of their input first
+        _wait_until(std::chrono::steady_clock::time_point::max(), [this] {
+            return std::all_of(_ptys.begin(), _ptys.end(), [] (const auto& entry) { return entry.second->input.empty(); });
+        });
+        _quit();
+    }},
 
-        } else if (cmd.arg == MODE_COMMAND) {
-            _input_mode = UserInputMode::COMMAND;
+    {Op::RUN, [&] (const Command& cmd) {
+        _start_job(kRunJobName, cmd.arg, ".gupty-run.out", ".gupty-run.err");
+        _wait_for_job(kRunJobName);
+    }},
 
-        } else {
-            // FIXME: make this impossible
-            std::cerr << std::endl;
-            std::cerr << "Error: unknown " << CMD_OUTPUT << " option: " << cmd.arg << std::endl;
-            _quit();
+    {Op::RUN_ASYNC, [&] (const Command& cmd) {
+        _start_job(cmd.target, cmd.arg, ".gupty-job-" + cmd.target + ".out", ".gupty-job-" + cmd.target + ".err");
+    }},
+
+    {Op::WAIT_JOB, [&] (const Command& cmd) {
+        _wait_for_job(cmd.target);
+    }},
+
+    {Op::PTY_OPEN, [&] (const Command& cmd) {
+        _open_pty(cmd.target, cmd.arg);
+    }},
 
+    {Op::USE, [&] (const Command& cmd) {
+        if (auto pty = _find_pty(cmd.target)) {
+            _use_pty(*pty);
         }
     }},
 
-    {CMD_PAUSE, [&] (const Command& cmd) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(boost::lexical_cast<int>(cmd.arg)));
+    {Op::WAIT_TIMEOUT, [&] (const Command& cmd) {
+        _wait_timeout = std::chrono::milliseconds(cmd.value);
     }},
 
-    {CMD_OUTPUT, [&] (const Command& cmd) {
-        // FIXME: use OutputModeNames
-        if (cmd.arg == OUTPUT_ALL) {
-            _output_mode = OutputMode::ALL;
+    {Op::WAIT_FOR_OUTPUT, [&] (const Command& cmd) {
+        OutputMatcher matcher;
+        matcher.addLiteral(cmd.arg);
+        _wait_for_output(std::move(matcher), cmd.arg);
+    }},
 
-        } else if (cmd.arg == OUTPUT_NONE) {
-            _output_mode = OutputMode::NONE;
+    {Op::WAIT_FOR_OUTPUT_REGEX, [&] (const Command& cmd) {
+        OutputMatcher matcher;
+        matcher.addRegex(cmd.arg);
+        _wait_for_output(std::move(matcher), cmd.arg);
+    }},
 
-        } else {
-            // FIXME: make this impossible
-            std::cerr << std::endl;
-            std::cerr << "Error: unknown " << CMD_OUTPUT << " option: " << cmd.arg << std::endl;
-            _quit();
+    {Op::FILTER_REDACT, [&] (const Command& cmd) {
+        _output_filter.addRedact(cmd.arg);
+    }},
 
-        }
+    {Op::FILTER_REDACT_REGEX, [&] (const Command& cmd) {
+        _output_filter.addRedactRegex(cmd.arg);
     }},
 
-    {CMD_EXIT, [&] (const Command& cmd) {
-        _quit();
+    {Op::FILTER_DROP_LINES, [&] (const Command& cmd) {
+        _output_filter.addDropLines(cmd.arg);
+    }},
+
+    {Op::FILTER_STRIP_ESCAPES, [&] (const Command& cmd) {
+        _output_filter.setStripEscapes(cmd.value);
+    }},
+
+    {Op::FILTER_CLEAR, [&] (const Command&) {
+        _flush_output_filter();
+        _output_filter.clear();
+    }},
+
+    {Op::PASTE_CHUNK_SIZE, [&] (const Command& cmd) {
+        _paste_chunk_size = cmd.value;
+    }},
+
+    {Op::PASTE_DELAY, [&] (const Command& cmd) {
+        _paste_delay = std::chrono::milliseconds(cmd.value);
+    }},
+
+    {Op::PASTE_BRACKETED, [&] (const Command& cmd) {
+        _bracketed_paste_mode = static_cast<BracketedPasteMode>(cmd.value);
+    }},
+
+    {Op::AUTO_KEY_DELAY, [&] (const Command& cmd) {
+        _auto_key_delay = std::chrono::milliseconds(cmd.value);
+    }},
+
+    {Op::AUTO_KEY_JITTER, [&] (const Command& cmd) {
+        _auto_key_jitter = cmd.value;
     }},
 
-    {CMD_RUN, [&] (const Command& cmd) {
-        std::string out = ".gupty-run.out";
-        std::string err = ".gupty-run.err";
-        // FIXME: append
-        boost::process::system(cmd.arg.c_str(), boost::process::std_out > out, boost::process::std_err > err);
+    {Op::AUTO_ENTER_DELAY, [&] (const Command& cmd) {
+        _auto_enter_delay = std::chrono::milliseconds(cmd.value);
     }},
 
-    {CMD_WAIT_FOR_ANY_KEY, [&] (const Command& cmd) {
+    {Op::WAIT_FOR_ANY_KEY, [&] (const Command&) {
         _line_status = LineStatus::EMPTY;
         _line = "";
         _line_character_it = _line.begin();
         _process_user_input();
     }},
 
-    {CMD_PASTE_KEYS, [&] (const Command& cmd) {
-        // https://stackoverflow.com/questions/236129/how-do-i-iterate-over-the-words-of-a-string/237280#237280
-        std::istringstream iss(cmd.arg);
-        std::vector<std::string> keys{std::istream_iterator<std::string>{iss}, std::istream_iterator<std::string>{}};
-        for (const auto& key : keys) {
-            if (keyCodes.find(key) != keyCodes.end()) {
-                _send_to_pty(keyCodes.at(key));
-            } else {
-                // FIXME: make this impossible
-                // unknown key - just ignore
-            }
+    {Op::PASTE_KEYS, [&] (const Command& cmd) {
+        for (const auto& code : cmd.keys) {
+            _send_to_pty(code);
         }
     }},
 
-    {CMD_TYPE_KEYS, [&] (const Command& cmd) {
-        // https://stackoverflow.com/questions/236129/how-do-i-iterate-over-the-words-of-a-string/237280#237280
-        std::istringstream iss(cmd.arg);
-        std::vector<std::string> keys{std::istream_iterator<std::string>{iss}, std::istream_iterator<std::string>{}};
-        for (const auto& key : keys) {
-            if (keyCodes.find(key) != keyCodes.end()) {
-                _line_status = LineStatus::EMPTY;
-                _line = keyCodes.at(key);
-                _line_character_it = _line.begin();
-                _process_user_input(false);
-                _send_to_pty(keyCodes.at(key));
-            } else {
-                // FIXME: make this impossible
-                // unknown key - just ignore
-            }
+    {Op::TYPE_KEYS, [&] (const Command& cmd) {
+        for (const auto& code : cmd.keys) {
+            _line_status = LineStatus::EMPTY;
+            _line = code;
+            _line_character_it = _line.begin();
+            _process_user_input(false);
+            _send_to_pty(code);
         }
     }},
 
-    {CMD_WAIT_FOR_AND_SEND_ENTER, [&] (const Command& cmd) {
-        _commandFns[CMD_WAIT_FOR_ENTER]({CMD_WAIT_FOR_ENTER, ""}); _commandFns[CMD_PASTE_KEY]({CMD_PASTE_KEY, KEY_Enter});
+    {Op::WAIT_FOR_AND_SEND_ENTER, [&] (const Command&) {
+        _wait_for_enter();
+        _send_to_pty(CODE_Enter);
     }},
 
-    {CMD_WAIT_FOR_ENTER, [&] (const Command& cmd) {
-        _line = "";
-        _line_character_it = _line.begin();
-        _line_status = LineStatus::LOADED;
-        _process_user_input();
+    {Op::WAIT_FOR_ENTER, [&] (const Command&) {
+        _wait_for_enter();
     }},
 
-    {CMD_PASTE, [&] (const Command& cmd) {
+    {Op::PASTE, [&] (const Command& cmd) {
         // if you want to wait for enter after this, then call wait_for_and_send_enter afterwards.
-        _send_to_pty(cmd.arg);
+        _paste(cmd.arg);
     }},
 
-    {CMD_PASTE_LINE, [&] (const Command& cmd) {
-        // same as paste, but also send the Enter at the end.
-        _commandFns[CMD_PASTE](cmd);
-        _commandFns[CMD_PASTE_KEYS]({CMD_PASTE_KEYS, KEY_Enter});
+    {Op::PASTE_LINE, [&] (const Command& cmd) {
+        // same as paste, but also send the Enter at the end (outside of any bracketed paste).
+        _paste(cmd.arg);
+        _send_to_pty(CODE_Enter);
     }},
 
-    {CMD_TYPE_LINE, [&] (const Command& cmd) {
+    {Op::TYPE_LINE, [&] (const Command& cmd) {
         // send line to shell
         _line_status = LineStatus::EMPTY;
         _line = cmd.arg;
@@ -274,7 +346,7 @@ Session::Session()
         }
     }},
 
-    {CMD_TYPE, [&] (const Command& cmd) {
+    {Op::TYPE, [&] (const Command& cmd) {
         // same as type_line, but without requiring the Enter after the line is done
         // (eg. so you can do more line editing with type_keys)
 
@@ -314,12 +386,7 @@ Session::Session()
         }
     }},
 }
-{
-    // aliases
-    // FIXME: make a lambda generator for aliases, and use it to define these aliases above next to their actual command
-    _commandFns[CMD_PASTE_KEY] = _commandFns[CMD_PASTE_KEYS];
-    _commandFns[CMD_TYPE_KEY] = _commandFns[CMD_TYPE_KEYS];
-}
+{ }
 
 void Session::setShell(const std::string& shell) {
     _shell = shell;
@@ -332,6 +399,10 @@ void Session::setShell(const std::string& shell) {
     }
 }
 
+void Session::setKeyTimeout(int millis) {
+    _key_timeout = std::chrono::milliseconds(millis);
+}
+
 void Session::setMonitor(const std::string& monitor_filename) {
     _monitor_filename = monitor_filename;
 }
@@ -340,79 +411,103 @@ void Session::setNoMonitor() {
     _monitor_filename.reset();
 }
 
+void Session::setMonitorSocket(const std::string& path) {
+    _monitor_socket_path = path;
+}
 
-void Session::init() {
-    if (_monitor_filename) {
-        _monitor_file = new std::ofstream(*_monitor_filename, std::ios::binary | std::ios::out | std::ios::trunc);
-        runtime_assert(_monitor_file != nullptr, "Could not open monitor file.");
-    }
-
-    runtime_assert(tcgetattr(STDIN_FILENO, &_orig_terminal_settings) == 0, "Could not retrieve terminal settings on stdin.");
-
-    _pty_fd = posix_openpt(O_RDWR);
-    runtime_assert(_pty_fd >= 0, "There was a problem opening pty.");
-
-    BOOST_LOG_TRIVIAL(debug) << "Opened pseudoterminal.";
-    BOOST_LOG_TRIVIAL(debug) << "  Pty device fd: " << _pty_fd;
-
-    runtime_assert(grantpt(_pty_fd) == 0, "Could not grant access to pty.");
-    runtime_assert(unlockpt(_pty_fd) == 0, "Could not unlock pty device.");
+void Session::setStateFile(const std::string& state_filename) {
+    _state_filename = state_filename;
+}
 
-    _pty_device_name = ptsname(_pty_fd);
-    runtime_assert(_pty_device_name != nullptr, "Could not get pty device name.");
-    BOOST_LOG_TRIVIAL(debug) << "  Pty device name: " << _pty_device_name;
+void Session::setResume() {
+    _resume = true;
+}
 
-    _child_pid = fork();
-    runtime_assert(_child_pid >= 0, "Could not fork child process.");
+void Session::setRecord(const std::string& record_filename) {
+    _record_filename = record_filename;
+}
 
-    if (_child_pid == 0) {
-        // In the child, set up and run the shell.
-        BOOST_LOG_TRIVIAL(debug) << "Closing pty fd.";
-        runtime_assert(close(_pty_fd) == 0, "Unable to close pty fd.");
-        _pty_fd = -2;
+void Session::setIO(int in_fd, int out_fd) {
+    _in_fd = in_fd;
+    _out_fd = out_fd;
+}
 
-        BOOST_LOG_TRIVIAL(debug) << "Creating new session for child.";
-        runtime_assert(setsid() != -1, "Could not start new session.");
+void Session::setWindowSize(unsigned short rows, unsigned short cols) {
+    winsize window_size{};
+    window_size.ws_row = rows;
+    window_size.ws_col = cols;
+    _window_size = window_size;
+}
 
-        BOOST_LOG_TRIVIAL(debug) << "Opening pty device in child to act as controlling terminal.";
-        auto fd = open(_pty_device_name, O_RDWR);
-        runtime_assert(fd >= 0, "Could not open pty device file.");
 
-        BOOST_LOG_TRIVIAL(debug) << "Connecting child stdin, stdout, and stderr to pty device.";
-        runtime_assert(dup2(fd, 0) == 0, "Could not connect child stdin to pty device");
-        runtime_assert(dup2(fd, 1) == 1, "Could not connect child stdout to pty device");
-        runtime_assert(dup2(fd, 2) == 2, "Could not connect child stderr to pty device");
+void Session::setFrameRate(unsigned int fps) {
+    _frame_interval = (fps > 0) ? std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::seconds(1)) / fps : std::chrono::steady_clock::duration(0);
+}
 
-        BOOST_LOG_TRIVIAL(debug) << "Closing fd.";
-        runtime_assert(close(fd) == 0, "Unable to close fd.");
+void Session::setFrameLimit(size_t bytes) {
+    _frame_limit = std::min(bytes, kMaxFrameLimit);
+}
 
-        std::vector<char*> argv;
-        argv.push_back(raw_c_str(_shell));
-        std::transform(_shell_args.begin(), _shell_args.end(), std::back_inserter(argv), raw_c_str);
-        argv.push_back(NULL);  // need to null terminate the array
+void Session::init() {
+    // (the input might not be a terminal, eg. when testing)
+    _in_is_tty = isatty(_in_fd);
+    if (_in_is_tty) {
+        runtime_assert(tcgetattr(_in_fd, &_orig_terminal_settings) == 0, "Could not retrieve terminal settings on stdin.");
+    }
 
-        BOOST_LOG_TRIVIAL(debug)
-            << "Launching shell (" << _shell << ") in child process with "
-            << argv.size() << " element array for argv:";
-        for (const auto& a : argv) {
-            if (a != NULL) {
-                BOOST_LOG_TRIVIAL(debug) << "  " << a;
-            } else {
-                BOOST_LOG_TRIVIAL(debug) << "  NULL";
-            }
+    std::vector<std::string> argv{_shell};
+    argv.insert(argv.end(), _shell_args.begin(), _shell_args.end());
+    auto& pty = _ptys[kMainPtyName];
+    pty = std::make_unique<Pty>(kMainPtyName, argv);
+    _shown = _active = pty.get();
+
+    // the event loop blocks the signals it watches, so it needs to be set up
+    // before starting any threads.
+    _loop = std::make_unique<EventLoop>();
+    _loop->watchFd(_in_fd, EventLoop::READABLE, [this] (uint32_t events) {
+        if (events & EventLoop::ERROR) {
+            throw std::runtime_error("Error encountered while polling stdin.");
+        }
+        _read_from_stdin();
+    }, true);  // (keys are always read before more output)
+    _watch_pty(*pty);
+    _loop->watchSignal(SIGWINCH, [this] {
+        // a window being dragged sends lots of these, so only pass the size
+        // on to the child once it has settled.
+        _loop->cancelTimer(_resize_timer);
+        _resize_timer = _loop->addTimer(std::chrono::steady_clock::now() + kResizeDebounce, [this] {
+            _sync_window_size();
+        });
+    });
+    _loop->watchSignal(SIGCHLD, [this] {
+        _reap_jobs();
+        for (auto& [name, pty] : _ptys) {
+            pty->reap();
         }
+    });
 
-        execvp(_shell.c_str(), argv.data());
-        runtime_assert(false, "execvp failed");  // FIXME include strerror(errno)
+    // the monitor has a writer thread, so only start it after forking
+    if (_monitor_filename) {
+        _monitor = std::make_unique<Monitor>(*_monitor_filename);
+    }
+    if (_monitor_socket_path) {
+        _monitor_socket = std::make_unique<MonitorSocket>(*_monitor_socket_path);
     }
 
     // set terminal to raw mode
-    termios terminal_settings = _orig_terminal_settings;
-    cfmakeraw(&terminal_settings);
-    runtime_assert(tcsetattr(STDIN_FILENO, TCSANOW, &terminal_settings) == 0, "Could not set terminal settings on stdin.");
+    if (_in_is_tty) {
+        termios terminal_settings = _orig_terminal_settings;
+        cfmakeraw(&terminal_settings);
+        runtime_assert(tcsetattr(_in_fd, TCSANOW, &terminal_settings) == 0, "Could not set terminal settings on stdin.");
+    }
 
     // set the pty window size to match parents
-    _sync_window_size();
+    auto window_size = _sync_window_size();
+
+    // like the monitor, the recorder has a writer thread
+    if (_record_filename) {
+        _recorder = std::make_unique<Recorder>(*_record_filename, window_size.ws_col, window_size.ws_row);
+    }
 
     _inited = true;
 }
@@ -423,16 +518,27 @@ Session::~Session() try {
     }
 
     BOOST_LOG_TRIVIAL(debug) << "Session::~Session starting";
+    _write_checkpoint();
     _input_mode = UserInputMode::QUITTING;
     _updateMonitor();
 
-    runtime_assert(close(_pty_fd) == 0, "Unable to close _pty_fd.");
-    runtime_assert(tcsetattr(STDIN_FILENO, TCSANOW, &_orig_terminal_settings) == 0, "Could not reset terminal settings on stdin.");
+    for (const auto& line : _latency_summary()) {
+        BOOST_LOG_TRIVIAL(info) << line;
+    }
+
+    _loop.reset();
+#ifdef __linux__
+    if (_splice_pipe[0] >= 0) {
+        close(_splice_pipe[0]);
+        close(_splice_pipe[1]);
+    }
+#endif
+    if (_in_is_tty) {
+        runtime_assert(tcsetattr(_in_fd, TCSANOW, &_orig_terminal_settings) == 0, "Could not reset terminal settings on stdin.");
+    }
 
-    BOOST_LOG_TRIVIAL(debug) << "killing child process";
-    // No need to check for failure - if the process has already gone away, then good.
-    // The other failure modes (EINVAL (invalid signal), EPERM (no perms to send signal)) are impossible here.
-    kill(_child_pid, SIGKILL);
+    BOOST_LOG_TRIVIAL(debug) << "killing child processes";
+    _ptys.clear();
 
     BOOST_LOG_TRIVIAL(debug) << "Session::~Session finished";
 } catch (const std::runtime_error& e) {
@@ -441,30 +547,441 @@ Session::~Session() try {
 }
 
 Commands Session::resolveCommands(const Lines& lines) {
+    auto commands = _resolve_lines(lines);
+    _link_commands(commands);
+    return commands;
+}
+
+Commands Session::_resolve_lines(const Lines& lines) {
     Commands commands;
-    for (const auto& line : lines) {
-        if (line[0] == '\0' || line[0] == '#') {
+    for (size_t i = 0; i < lines.size(); i++) {
+        if (lines[i][0] == '\0' || lines[i][0] == '#') {
             continue;
         }
+        auto line = _substitute(lines[i]);
         auto spacepos = line.find(" ");  // if none, will return npos
         auto name = line.substr(0, spacepos);
-        if (_commandFns.find(name) == _commandFns.end()) {
+        auto arg = (spacepos != std::string::npos) ? line.substr(spacepos + 1) : "";
+
+        // Parse the argument now, so that running the command doesn't have to.
+        auto bad_arg = [&] (const std::string& what) {
+            std::cerr << "Error: " << what << " for " << name << ": " << arg << std::endl;
+            throw std::runtime_error(what);
+        };
+
+        auto append = [&] (Commands subcmds) {
+            if (commands.size() + subcmds.size() > kMaxExpandedCommands) {
+                bad_arg("script expands to too many commands");
+            }
+            commands.insert(commands.end(), std::make_move_iterator(subcmds.begin()), std::make_move_iterator(subcmds.end()));
+        };
+
+        if (name == CMD_INCLUDE) {
+            _sources.push_back(arg);
+            append(_resolve_lines(readLines(arg)));
+            continue;
+
+        } else if (name == CMD_SET) {
+            auto var_end = arg.find(" ");
+            auto var = arg.substr(0, var_end);
+            if ( ! is_variable_name(var)) {
+                bad_arg("invalid variable name");
+            }
+            _variables[var] = (var_end != std::string::npos) ? arg.substr(var_end + 1) : "";
+            continue;
+
+        } else if (name == CMD_DEFINE) {
+            auto end = _find_block_end(lines, i);
+            std::istringstream iss(arg);
+            std::string macro_name;
+            Macro macro;
+            iss >> macro_name;
+            for (auto param = std::istream_iterator<std::string>{iss}; param != std::istream_iterator<std::string>{}; param++) {
+                if ( ! is_variable_name(*param)) {
+                    bad_arg("invalid parameter name");
+                }
+                macro.params.push_back(*param);
+            }
+            if ( ! is_variable_name(macro_name)) {
+                bad_arg("invalid macro name");
+            }
+            // (the body is only parsed when it's called, once its parameters are known)
+            macro.body.assign(lines.begin() + i + 1, lines.begin() + end);
+            _macros[macro_name] = std::move(macro);
+            i = end;
+            continue;
+
+        } else if (name == CMD_CALL) {
+            auto name_end = arg.find(" ");
+            auto macro = _macros.find(arg.substr(0, name_end));
+            if (macro == _macros.end()) {
+                bad_arg("unknown macro (not defined earlier)");
+            }
+            // the arguments are separated by spaces, except that the last
+            // one is the rest of the line
+            std::map<std::string, std::string> scope;
+            auto rest = (name_end != std::string::npos) ? arg.substr(name_end + 1) : "";
+            const auto& params = macro->second.params;
+            for (size_t p = 0; p < params.size(); p++) {
+                if (rest.empty()) {
+                    bad_arg("missing argument " + params[p]);
+                }
+                auto arg_end = (p + 1 < params.size()) ? rest.find(" ") : std::string::npos;
+                scope[params[p]] = rest.substr(0, arg_end);
+                rest = (arg_end != std::string::npos) ? rest.substr(arg_end + 1) : "";
+            }
+            if ( ! rest.empty()) {
+                bad_arg("too many arguments");
+            }
+            if (_scopes.size() >= kMaxNesting) {
+                bad_arg("too deeply nested (does the macro call itself?)");
+            }
+            _scopes.push_back(std::move(scope));
+            append(_resolve_lines(macro->second.body));
+            _scopes.pop_back();
+            continue;
+
+        } else if (name == CMD_REPEAT) {
+            auto end = _find_block_end(lines, i);
+            std::istringstream iss(arg);
+            std::string count_str;
+            std::string var;
+            iss >> count_str >> var;
+            int64_t count = -1;
+            try {
+                count = boost::lexical_cast<int64_t>(count_str);
+            } catch (const boost::bad_lexical_cast&) {
+            }
+            if (count < 0 || count > kMaxRepeatCount) {
+                bad_arg("invalid count (up to " + std::to_string(kMaxRepeatCount) + ")");
+            }
+            if ( ! var.empty() && ! is_variable_name(var)) {
+                bad_arg("invalid variable name");
+            }
+            if (_scopes.size() >= kMaxNesting) {
+                bad_arg("too deeply nested");
+            }
+            Lines body(lines.begin() + i + 1, lines.begin() + end);
+            for (int64_t n = 1; n <= count; n++) {
+                _scopes.push_back({});
+                if ( ! var.empty()) {
+                    _scopes.back()[var] = std::to_string(n);
+                }
+                append(_resolve_lines(body));
+                _scopes.pop_back();
+            }
+            i = end;
+            continue;
+
+        } else if (name == CMD_END) {
+            bad_arg("end without define or repeat");
+        }
+
+        bool setup = false;
+        if (name == CMD_SETUP) {
+            // the rest of the line is the command to mark
+            setup = true;
+            spacepos = arg.find(" ");
+            name = arg.substr(0, spacepos);
+            arg = (spacepos != std::string::npos) ? arg.substr(spacepos + 1) : "";
+        }
+        std::optional<std::string> on_pty;
+        if (name == CMD_ON) {
+            // the pty name, and then the command to send to it
+            spacepos = arg.find(" ");
+            on_pty = arg.substr(0, spacepos);
+            arg = (spacepos != std::string::npos) ? arg.substr(spacepos + 1) : "";
+            spacepos = arg.find(" ");
+            name = arg.substr(0, spacepos);
+            arg = (spacepos != std::string::npos) ? arg.substr(spacepos + 1) : "";
+        }
+
+        Command cmd;
+        cmd.op = opForName(name);
+        cmd.name = name;
+        cmd.arg = arg;
+        if (cmd.op == Op::UNKNOWN) {
             // unknown command
             std::cerr << "Error: unknown command: " << name << std::endl;
             throw std::runtime_error("unknown command");
         }
-        auto arg = (spacepos != std::string::npos) ? line.substr(spacepos + 1) : "";
-        if (name == "include") {
-            auto subcmds = resolveCommands(readLines(arg));
-            commands.insert(commands.end(), std::make_move_iterator(subcmds.begin()), std::make_move_iterator(subcmds.end()));
-        } else {
-            commands.push_back({name, arg});
+        cmd.setup = setup;
+        if (setup && (cmd.op == Op::SKIP || cmd.op == Op::RESUME || cmd.op == Op::LABEL || cmd.op == Op::EXIT || cmd.op == Op::SET_MODE)) {
+            bad_arg("not allowed as a setup command");
+        }
+        if (on_pty) {
+            if (*on_pty != kMainPtyName && ! _pty_names.contains(*on_pty)) {
+                bad_arg("unknown pty (not opened by an earlier pty_open)");
+            }
+            if ( ! opUsesPty(cmd.op)) {
+                bad_arg("not allowed with on");
+            }
+            cmd.target = *on_pty;
+        }
+
+        if (cmd.op == Op::SET_MODE) {
+            auto mode = UserInputModeNames(boost::algorithm::to_upper_copy(arg));
+            if (mode == UserInputMode::UNKNOWN || mode == UserInputMode::QUITTING) {
+                bad_arg("unknown mode");
+            }
+            cmd.value = static_cast<int64_t>(mode);
+
+        } else if (cmd.op == Op::OUTPUT) {
+            auto mode = OutputModeNames(boost::algorithm::to_upper_copy(arg));
+            if (mode == OutputMode::UNKNOWN) {
+                bad_arg("unknown output option");
+            }
+            cmd.value = static_cast<int64_t>(mode);
+
+        } else if (cmd.op == Op::PASTE_BRACKETED) {
+            auto mode = BracketedPasteModeNames(boost::algorithm::to_upper_copy(arg));
+            if (mode == BracketedPasteMode::UNKNOWN) {
+                bad_arg("unknown bracketed paste option");
+            }
+            cmd.value = static_cast<int64_t>(mode);
+
+        } else if (cmd.op == Op::PAUSE || cmd.op == Op::WAIT_TIMEOUT || cmd.op == Op::PASTE_DELAY || cmd.op == Op::PASTE_CHUNK_SIZE
+                || cmd.op == Op::AUTO_KEY_DELAY || cmd.op == Op::AUTO_KEY_JITTER || cmd.op == Op::AUTO_ENTER_DELAY) {
+            auto what = (cmd.op == Op::PASTE_CHUNK_SIZE) ? "invalid size" : (cmd.op == Op::AUTO_KEY_JITTER) ? "invalid percentage" : "invalid duration";
+            try {
+                cmd.value = boost::lexical_cast<int64_t>(arg);
+            } catch (const boost::bad_lexical_cast&) {
+                bad_arg(what);
+            }
+            if (cmd.value < 0) {
+                bad_arg(what);
+            }
+
+        } else if (cmd.op == Op::WAIT_FOR_OUTPUT || cmd.op == Op::WAIT_FOR_OUTPUT_REGEX
+                || cmd.op == Op::FILTER_REDACT || cmd.op == Op::FILTER_REDACT_REGEX || cmd.op == Op::FILTER_DROP_LINES) {
+            if (arg.empty()) {
+                bad_arg("missing pattern");
+            }
+            if (cmd.op == Op::WAIT_FOR_OUTPUT_REGEX) {
+                try {
+                    OutputMatcher().addRegex(arg);
+                } catch (const std::runtime_error& e) {
+                    bad_arg(std::string("invalid regex (") + e.what() + ")");
+                }
+            } else if (cmd.op == Op::FILTER_REDACT_REGEX || cmd.op == Op::FILTER_DROP_LINES) {
+                try {
+                    OutputFilter().addRedactRegex(arg);
+                } catch (const std::runtime_error& e) {
+                    bad_arg(std::string("invalid regex (") + e.what() + ")");
+                }
+            }
+
+        } else if (cmd.op == Op::FILTER_STRIP_ESCAPES) {
+            static const std::map<std::string, unsigned> kinds = {
+                {"none", 0},
+                {"sgr", OutputFilter::kStripSgr},
+                {"osc", OutputFilter::kStripOsc},
+                {"other", OutputFilter::kStripOther},
+                {"all", OutputFilter::kStripAll},
+            };
+            std::istringstream iss(arg);
+            for (auto word = std::istream_iterator<std::string>{iss}; word != std::istream_iterator<std::string>{}; word++) {
+                auto kind = kinds.find(*word);
+                if (kind == kinds.end()) {
+                    bad_arg("unknown kind of escape sequence");
+                }
+                cmd.value |= kind->second;
+            }
+
+        } else if (cmd.op == Op::LABEL) {
+            if (arg.empty() || std::any_of(arg.begin(), arg.end(), [] (char ch) { return std::isspace(static_cast<unsigned char>(ch)); })) {
+                bad_arg("invalid label name");
+            }
+
+        } else if (cmd.op == Op::FILTER_CLEAR) {
+            if ( ! arg.empty()) {
+                bad_arg("unexpected argument");
+            }
+
+        } else if (cmd.op == Op::RUN_ASYNC || cmd.op == Op::WAIT_JOB) {
+            auto spacepos = arg.find(" ");
+            cmd.target = arg.substr(0, spacepos);
+            if ( ! is_simple_name(cmd.target)) {
+                bad_arg("invalid job name");
+            }
+            if (cmd.op == Op::RUN_ASYNC) {
+                cmd.arg = (spacepos != std::string::npos) ? arg.substr(spacepos + 1) : "";
+                if (cmd.arg.empty()) {
+                    bad_arg("missing command");
+                }
+                _job_names.insert(cmd.target);
+                if (setup) {
+                    _setup_job_names.insert(cmd.target);
+                }
+            } else if (spacepos != std::string::npos) {
+                bad_arg("unexpected argument");
+            } else if ( ! _job_names.contains(cmd.target)) {
+                bad_arg("unknown job (not started by an earlier run_async)");
+            } else if (setup && ! _setup_job_names.contains(cmd.target)) {
+                // (when resuming, only the setup commands are replayed)
+                bad_arg("job not started by an earlier setup run_async");
+            }
+
+        } else if (cmd.op == Op::PTY_OPEN || cmd.op == Op::USE) {
+            auto spacepos = arg.find(" ");
+            cmd.target = arg.substr(0, spacepos);
+            if ( ! is_simple_name(cmd.target)) {
+                bad_arg("invalid pty name");
+            }
+            if (cmd.op == Op::PTY_OPEN) {
+                // (without a command, the pty runs the shell)
+                cmd.arg = (spacepos != std::string::npos) ? arg.substr(spacepos + 1) : "";
+                if (cmd.target == kMainPtyName) {
+                    bad_arg("the main pty is always open");
+                }
+                _pty_names.insert(cmd.target);
+            } else if (spacepos != std::string::npos) {
+                bad_arg("unexpected argument");
+            } else if (cmd.target != kMainPtyName && ! _pty_names.contains(cmd.target)) {
+                bad_arg("unknown pty (not opened by an earlier pty_open)");
+            }
+
+        } else if (cmd.op == Op::PASTE_KEYS || cmd.op == Op::TYPE_KEYS) {
+            // https://stackoverflow.com/questions/236129/how-do-i-iterate-over-the-words-of-a-string/237280#237280
+            std::istringstream iss(arg);
+            for (auto key = std::istream_iterator<std::string>{iss}; key != std::istream_iterator<std::string>{}; key++) {
+                auto code = keyCodes.find(*key);
+                if (code == keyCodes.end()) {
+                    bad_arg("unknown key name");
+                }
+                cmd.keys.push_back(code->second);
+            }
         }
+
+        commands.push_back(std::move(cmd));
     }
     return commands;
 }
 
-constexpr auto CODE_clearscr = "\033[3J\033[H\033[2J";
+std::string Session::_substitute(const std::string& line) {
+    auto pos = line.find("${");
+    if (pos == std::string::npos) {
+        return line;
+    }
+
+    std::string result(line, 0, pos);
+    while (pos != std::string::npos) {
+        if (pos > 0 && line[pos - 1] == '$') {
+            // $${ is a literal ${ (the first $ has already been copied)
+            result += '{';
+            auto next = line.find("${", pos + 2);
+            result.append(line, pos + 2, next - (pos + 2));
+            pos = next;
+            continue;
+        }
+        auto close = line.find('}', pos + 2);
+        auto var = line.substr(pos + 2, close - (pos + 2));
+        if (close == std::string::npos || ! is_variable_name(var)) {
+            // not one of ours (eg. ${x:-y} for the shell), so leave it alone
+            close = pos + 1;
+            result += "${";
+        } else {
+            std::optional<std::string> value;
+            for (auto scope = _scopes.rbegin(); scope != _scopes.rend() && ! value; scope++) {
+                if (auto it = scope->find(var); it != scope->end()) {
+                    value = it->second;
+                }
+            }
+            if (auto it = _variables.find(var); ! value && it != _variables.end()) {
+                value = it->second;
+            }
+            if (auto env = std::getenv(var.c_str()); ! value && env) {
+                value = env;
+                _environment_used[var] = *value;
+            }
+            if ( ! value) {
+                std::cerr << "Error: unknown variable ${" << var << "} in: " << line << std::endl;
+                throw std::runtime_error("unknown variable");
+            }
+            result += *value;
+        }
+        auto next = line.find("${", close + 1);
+        result.append(line, close + 1, next == std::string::npos ? std::string::npos : next - (close + 1));
+        pos = next;
+    }
+    return result;
+}
+
+size_t Session::_find_block_end(const Lines& lines, size_t begin) const {
+    size_t depth = 0;
+    for (size_t i = begin; i < lines.size(); i++) {
+        auto name = lines[i].substr(0, lines[i].find(" "));
+        if (name == CMD_DEFINE || name == CMD_REPEAT) {
+            depth++;
+        } else if (name == CMD_END && --depth == 0) {
+            return i;
+        }
+    }
+    std::cerr << "Error: missing end for: " << lines[begin] << std::endl;
+    throw std::runtime_error("missing end");
+}
+
+void Session::_link_commands(Commands& commands) {
+    // Work backwards, so that the next resume is always known.
+    std::set<std::string> labels;
+    size_t next_resume = commands.size();
+    for (size_t i = commands.size(); i-- > 0; ) {
+        auto& cmd = commands[i];
+        if (cmd.op == Op::RESUME) {
+            next_resume = i;
+        } else if (cmd.op == Op::SKIP) {
+            cmd.value = next_resume;
+        } else if (cmd.op == Op::LABEL && ! labels.insert(cmd.arg).second) {
+            std::cerr << "Error: duplicate label for " << cmd.name << ": " << cmd.arg << std::endl;
+            throw std::runtime_error("duplicate label");
+        }
+    }
+}
+
+void Session::_index_commands() {
+    _labels.clear();
+    _sections.clear();
+    _labels_before.clear();
+    _labels_before.reserve(_commands.size() + 1);
+    for (size_t i = 0; i < _commands.size(); i++) {
+        _labels_before.push_back(_sections.size());
+        if (_commands[i].op == Op::LABEL) {
+            _labels.emplace(_commands[i].arg, i);
+            _sections.push_back(i);
+        }
+    }
+    _labels_before.push_back(_sections.size());
+}
+
+void Session::_seek(size_t index) {
+    BOOST_LOG_TRIVIAL(debug) << "Seeking to command " << (index + 1);
+    throw exception::seek(index);
+}
+
+Commands Session::loadScript(const std::string& filename, const std::string& cache_filename) {
+    _script_filename = filename;
+    if ( ! cache_filename.empty()) {
+        if (auto commands = readCompiledCommands(cache_filename, filename, &_sources)) {
+            _sources_hash = hashSources(_sources);
+            return std::move(*commands);
+        }
+    }
+
+    _sources = {filename};
+    _job_names.clear();
+    _setup_job_names.clear();
+    _pty_names.clear();
+    _macros.clear();
+    _variables.clear();
+    _environment_used.clear();
+    auto commands = resolveCommands(readLines(filename));
+    _sources_hash = hashSources(_sources);
+
+    if ( ! cache_filename.empty()) {
+        writeCompiledCommands(cache_filename, commands, _sources, _environment_used);
+    }
+    return commands;
+}
 
 constexpr auto FMT_RESET = "\033[0m";
 constexpr auto FMT_BOLD = "\033[1m";
@@ -507,274 +1024,937 @@ constexpr auto FMT_BG_BRIGHT_MAGENTA = "\033[105m";
 constexpr auto FMT_BG_BRIGHT_CYAN = "\033[106m";
 constexpr auto FMT_BG_BRIGHT_WHITE = "\033[107m";
 
+std::string Session::_format_monitor_line(Commands::const_iterator it, size_t num_digits) const {
+    std::ostringstream oss;
+    std::string fmt_name = FMT_FG_GREEN;
+    std::string fmt_arg = FMT_BOLD;
+    std::string fmt_target = FMT_FG_YELLOW;
+    if (it->op == Op::NOTE) {
+        fmt_arg += FMT_FG_CYAN;
+    } else if (it->op == Op::LABEL) {
+        fmt_arg += FMT_FG_MAGENTA;
+    }
+    oss << std::setw(num_digits) << (it - _commands.cbegin() + 1) << std::setw(0) << ": ";
+    if (it->setup) {
+        oss << FMT_FAINT << CMD_SETUP << FMT_RESET << " ";
+    }
+    bool on_pty = ! it->target.empty() && opUsesPty(it->op);
+    if (on_pty) {
+        oss << FMT_FAINT << CMD_ON << FMT_RESET << " " << fmt_target << it->target << FMT_RESET << " ";
+    }
+    oss << fmt_name << it->name << FMT_RESET << " ";
+    if ( ! it->target.empty() && ! on_pty) {
+        oss << fmt_target << it->target << FMT_RESET << " ";
+    }
+    oss << fmt_arg << it->arg << FMT_RESET;
+    return oss.str();
+}
+
+std::vector<std::string> Session::_latency_summary() const {
+    return {
+        "Latency (key to pty):       " + _key_latency.summary(),
+        "Latency (pty to stdout):    " + _output_latency.summary(),
+        "Latency (monitor update):   " + _monitor_latency.summary(),
+    };
+}
+
 void Session::_updateMonitor() {
-    if (_monitor_file == nullptr) {
+    if ( ! _monitor && ! _monitor_socket) {
         return;
     }
-    *_monitor_file << CODE_clearscr;
+    auto start = std::chrono::steady_clock::now();
+    _draw_monitor();
+    _monitor_latency.record(std::chrono::steady_clock::now() - start);
+}
+
+void Session::_draw_monitor() {
+    if (_input_mode != UserInputMode::COMMAND) {
+        // the latencies are only shown until COMMAND mode is left
+        _latency_shown = 0;
+    }
+
+    auto total_lines = _commands.size();
+    auto it = Commands::const_iterator(_current_command);
+    if (total_lines == 0) {
+        it = _commands.cbegin();
+    } else if (_monitor_num_pre_lines + _monitor_num_total_lines > total_lines) {
+        // just always show the full thing
+        it = _commands.cbegin();
+    } else if (_commands.cend() - it < _monitor_num_total_lines - _monitor_num_pre_lines) {
+        it = _commands.cend() - _monitor_num_total_lines;
+    } else {
+        for (unsigned int i = 0; i < _monitor_num_pre_lines && it != _commands.cbegin(); i++) {
+            it--;
+        }
+    }
 
+    // Only the input mode, the current command, and the window position are
+    // able to change what is shown, so if none of them have changed then
+    // there's nothing to do.
+    MonitorState state{
+        _input_mode,
+        static_cast<size_t>(total_lines == 0 ? 0 : _current_command - _commands.begin()),
+        static_cast<size_t>(it - _commands.cbegin()),
+        total_lines,
+        _commands_generation,
+        _latency_shown,
+        _label_prompt,
+    };
+    if (_monitor_state && *_monitor_state == state) {
+        return;
+    }
+    _monitor_state = state;
+
+    if (_monitor_command_lines_generation != _commands_generation) {
+        // (re)build the cache of formatted command lines
+        auto num_digits = std::to_string(total_lines).length();
+        _monitor_command_lines.clear();
+        _monitor_command_lines.reserve(total_lines);
+        for (auto c = _commands.cbegin(); c != _commands.cend(); c++) {
+            _monitor_command_lines.push_back(_format_monitor_line(c, num_digits));
+        }
+        _monitor_command_lines_generation = _commands_generation;
+    }
 
-    std::string fmt_statusline;
+    _monitor_rows.resize(_monitor_num_total_lines + 4);
+    auto row = _monitor_rows.begin();
 
     // FIXME: use a lookup table
+    std::string& statusline = *row++;
+    statusline.clear();
     if (_input_mode == UserInputMode::QUITTING) {
-        fmt_statusline += FMT_BG_RED;
-        fmt_statusline += FMT_FG_WHITE;
+        statusline += FMT_BG_RED;
+        statusline += FMT_FG_WHITE;
     } else if (_input_mode == UserInputMode::INSERT) {
-        fmt_statusline += FMT_BG_BRIGHT_GREEN;
-        fmt_statusline += FMT_FG_BLACK;
+        statusline += FMT_BG_BRIGHT_GREEN;
+        statusline += FMT_FG_BLACK;
     } else if (_input_mode == UserInputMode::COMMAND) {
-        fmt_statusline += FMT_BG_BRIGHT_YELLOW;
-        fmt_statusline += FMT_FG_BLACK;
+        statusline += FMT_BG_BRIGHT_YELLOW;
+        statusline += FMT_FG_BLACK;
     } else if (_input_mode == UserInputMode::PASSTHROUGH) {
-        fmt_statusline += FMT_BG_BRIGHT_BLUE;
-        fmt_statusline += FMT_FG_WHITE;
+        statusline += FMT_BG_BRIGHT_BLUE;
+        statusline += FMT_FG_WHITE;
     } else if (_input_mode == UserInputMode::AUTO) {
-        fmt_statusline += FMT_RESET;
+        statusline += FMT_RESET;
     }
-    *_monitor_file << fmt_statusline << "Input mode: " << FMT_BOLD << UserInputModeNames(_input_mode) << FMT_RESET << std::endl;
-    *_monitor_file << std::endl;
-
+    statusline += "Input mode: ";
+    statusline += FMT_BOLD;
+    statusline += UserInputModeNames(_input_mode);
+    statusline += FMT_RESET;
+    if (_label_prompt) {
+        statusline += "    Jump to label: ";
+        statusline += *_label_prompt;
+    }
+    (row++)->clear();
 
-    auto total_lines = _commands.size();
-    auto num_digits  = boost::lexical_cast<std::string>(total_lines).length();
-    auto it = _current_command;
-    if (_monitor_num_pre_lines + _monitor_num_total_lines > total_lines) {
-        // just always show the full thing
-        it = _commands.begin();
-    } else if (_commands.end() - it < _monitor_num_total_lines - _monitor_num_pre_lines) {
-        it = _commands.end() - _monitor_num_total_lines;
-    } else {
-        for (unsigned int i = 0; i < _monitor_num_pre_lines && it != _commands.begin(); i++) {
-            it--;
-        }
+    for (unsigned int i = 0; i < _monitor_num_total_lines && it != _commands.cend(); i++) {
+        *row = (total_lines > 0 && it == _current_command) ? " --> " : "     ";
+        *row += _monitor_command_lines[it - _commands.cbegin()];
+        row++;
+        it++;
     }
 
-    for (unsigned int i = 0; i < _monitor_num_total_lines && it != _commands.end(); i++) {
-        auto origw = _monitor_file->width();
-        std::string fmt_name = FMT_FG_GREEN;
-        std::string fmt_arg = FMT_BOLD;
-        if (it->name == CMD_NOTE) {
-            fmt_arg += FMT_FG_CYAN;
+    (row++)->clear();
+    *row++ = "Total lines: " + std::to_string(total_lines);
+    _monitor_rows.erase(row, _monitor_rows.end());
+
+    if (_latency_shown) {
+        _monitor_rows.emplace_back();
+        for (auto& line : _latency_summary()) {
+            _monitor_rows.push_back(std::move(line));
         }
-        *_monitor_file << (it == _current_command ? " --> " : "     ") << std::setw(num_digits) << (it - _commands.begin() + 1) << std::setw(origw) << ": " << fmt_name << it->name << FMT_RESET << " " << fmt_arg << it->arg << FMT_RESET << std::endl;
-        it++;
     }
 
-    *_monitor_file << std::endl;
-    *_monitor_file << "Total lines: " << total_lines  << std::endl;
+    if (_monitor) {
+        _monitor->show(_monitor_rows);
+    }
+    if (_monitor_socket) {
+        _monitor_socket->show(_monitor_rows);
+    }
 }
 
 void Session::run(Commands commands) {
     BOOST_LOG_TRIVIAL(debug) << "Beginning session run.";
 
     _commands = commands;
+    _commands_generation++;
+    _index_commands();
     _current_command = _commands.begin();
+    if (_resume) {
+        _resume_from_checkpoint();
+    }
+    _checkpoints_started = true;
 
     // process script and user input
-    while (_current_command != _commands.end()) {
-        if (_skipping) {
-            _current_command++;
-            if (_current_command->name == CMD_RESUME) {
-                _commandFns[_current_command->name](*_current_command);
+    while (true) {
+        try {
+            while (_current_command != _commands.end()) {
+                // commands were all validated when they were resolved
+                _updateMonitor();
+                _checkpoint();
+                // a key that was used up by an earlier command has nothing to do with this one's writes
+                _key_arrived.reset();
+                if (_recorder) {
+                    // so that playback can jump straight to any command
+                    auto& cmd = *_current_command;
+                    _recorder->marker(std::to_string(_current_command - _commands.begin() + 1) + ": " + cmd.name + " " + cmd.arg);
+                }
+                _run_command(*_current_command);
+                _updateMonitor();
+
+                if (_line_status != LineStatus::RELOAD) {
+                    _current_command++;  // don't advance line pointer if we need to reload
+                }
             }
-            continue;
-        }
 
-        if (_commandFns.find(_current_command->name) != _commandFns.end()) {
-            _updateMonitor();
-            _commandFns[_current_command->name](*_current_command);
-            _updateMonitor();
-        } else {
-            // unknown command - should not be possible
-            std::cerr << std::endl;
-            std::cerr << "Error: unknown command: " << _current_command->name << std::endl;
-            _quit();
-        }
+            // out of commands - go into free typing (passthrough) mode
+            if (_input_mode != UserInputMode::AUTO) {
+                _input_mode = UserInputMode::PASSTHROUGH;
+                // if the user exits passthrough mode, goes into insert mode, and then presses enter, then we will exit.
+                // otherwise, the user can just exit passthrough mode into command mode, and type q to exit.
+                _wait_for_enter();
+            }
+            break;
 
-        if (_line_status != LineStatus::RELOAD) {
-            _current_command++;  // don't advance line pointer if we need to reload
+        } catch (const exception::seek& e) {
+            // (from a skip, or from COMMAND mode) whatever was happening is
+            // abandoned, and the new command starts afresh
+            _current_command = _commands.begin() + e.index;
+            _line_status = LineStatus::EMPTY;
         }
     }
 
-    // out of commands - go into free typing (passthrough) mode
-    if (_input_mode != UserInputMode::AUTO) {
-        _commandFns[CMD_SET_MODE]({CMD_SET_MODE, MODE_PASSTHROUGH});
-        // if the user exits passthrough mode, goes into insert mode, and then presses enter, then we will exit.
-        // otherwise, the user can just exit passthrough mode into command mode, and type q to exit.
-        _commandFns[CMD_WAIT_FOR_ENTER]({CMD_WAIT_FOR_ENTER, ""});
-    }
-
     BOOST_LOG_TRIVIAL(debug) << "Session run completed.";
 }
 
 void Session::_process_pty_output() {
-    // check if the pty has outputted anything, and if so, read it and
-    // deal with it.
-    char ch;
-    int  rc;
-
-    pollfd polls;
-    polls.fd = _pty_fd;
-    polls.events = POLLIN;
+    if (_frame_interval.count() > 0) {
+        _buffer_pty_output();
+        return;
+    }
 
+    // the pty is readable, so read everything that is available (the fd
+    // is non-blocking, so this stops as soon as the pty runs dry), and
+    // deal with it.
+    auto start = std::chrono::steady_clock::now();
     while (true) {
-        rc = poll(&polls, 1, 0);
-        if (rc < 0) {
-            throw std::runtime_error("There was a problem polling pty fd.");
-        } else if (rc == 0) {
+#ifdef __linux__
+        auto spliced = _splice_pty_output();
+        if (spliced > 0) {
+            continue;
+        } else if (spliced == 0) {
+            break;
+        }
+#endif
+        if ( ! _read_from_pty()) {
             break;
         }
-        _send_to_stdout(_get_from_pty());
+        if (_pty_output.saturated()) {
+            // don't let the buffer stall the reads, send what we have so far.
+            _send_to_stdout(_pty_output);
+        }
     }
-}
 
-namespace {
+    // everything available has been read, so send it all in one go.
+    _send_to_stdout(_pty_output);
+    _output_latency.record(std::chrono::steady_clock::now() - start);
+}
 
-std::string read_from_fd(int fd) {
-    constexpr size_t BUF_SIZE = 128;
-    char buffer[BUF_SIZE];
-    std::string s;
+void Session::_buffer_pty_output() {
+    for (int i = 0; i < kMaxFrameReads; i++) {
+        if (_pty_output.saturated()) {
+            // (only possible without a frame limit) stop reading, so that the
+            // child has to wait, until the next frame has made room.
+            _pty_paused = true;
+            _update_pty_events(*_shown);
+            break;
+        }
+        if ( ! _read_from_pty()) {
+            break;
+        }
+        if (_frame_limit > 0 && _pty_output.size() > _frame_limit) {
+            _skip_pty_output(_pty_output.size() - _frame_limit);
+        }
+    }
 
-    while (s.empty()) {
+    if (_pty_output.empty() || _frame_pending) {
+        return;
+    }
+    auto due = _last_frame + _frame_interval;
+    if (due <= std::chrono::steady_clock::now()) {
+        // nothing has been sent for a while (eg. this is an echoed key), so there's no need to wait
+        _send_frame();
+    } else {
+        _frame_pending = true;
+        _frame_timer = _loop->addTimer(due, [this] {
+            _send_frame();
+        });
+    }
+}
 
-        auto count = read(fd, buffer, BUF_SIZE);
-        s += std::string(buffer, count);
+void Session::_send_frame() {
+    _loop->cancelTimer(_frame_timer);
+    _frame_pending = false;
+    _last_frame = std::chrono::steady_clock::now();
 
-        while (true) {
-            pollfd stdinpoll;
-            stdinpoll.fd = fd;
-            stdinpoll.events = POLLIN;
-            int rc = poll(&stdinpoll, 1, 0);
-            if (rc < 0) {
-                throw std::runtime_error("There was a problem polling stdin.");
-            } else if (rc == 0) {
-                break;
-            }
-            auto count = read(fd, buffer, BUF_SIZE);
-            s += std::string(buffer, count);
+    if (_frame_skipped > 0) {
+        if (_output_mode != OutputMode::NONE) {
+            _write_to_stdout(std::string("\r\n") + FMT_FAINT + "[" + std::to_string((_frame_skipped + 1023) / 1024) + " KB skipped]" + FMT_RESET + "\r\n");
         }
+        _frame_skipped = 0;
     }
+    _send_to_stdout(_pty_output);
 
-    return s;
+    if (_pty_paused) {
+        _pty_paused = false;
+        _update_pty_events(*_shown);
+    }
 }
 
-void write_to_fd(int fd, const std::string& s) {
-    const auto cstr = s.c_str();
-    const auto len = s.length();
-    auto num_written = 0;
-    num_written += write(fd, cstr + num_written, len - num_written);
-    while (num_written < len) {
-        num_written += write(fd, cstr + num_written, len - num_written);
+void Session::_skip_pty_output(size_t n) {
+    bool match = _output_matcher && _shown == _active;
+    bool watch_bracketed_paste = (_bracketed_paste_mode == BracketedPasteMode::AUTO);
+    if (match || watch_bracketed_paste || _shown->logging()) {
+        // skipped output still counts when waiting for output (and is still logged)
+        iovec iov[2];
+        auto count = _pty_output.data(iov);
+        size_t remaining = n;
+        for (int i = 0; i < count && remaining > 0; i++) {
+            auto len = std::min(iov[i].iov_len, remaining);
+            std::string_view data(static_cast<const char*>(iov[i].iov_base), len);
+            if (match) {
+                _output_matcher->feed(data);
+            }
+            if (watch_bracketed_paste) {
+                _watch_for_bracketed_paste(*_shown, data);
+            }
+            _shown->log(data);
+            remaining -= len;
+        }
     }
+    _pty_output.consume(n);
+    _frame_skipped += n;
 }
 
+namespace {
+
+void write_to_fd(int fd, std::string_view s) {
+    size_t num_written = 0;
+    while (num_written < s.size()) {
+        auto count = write(fd, s.data() + num_written, s.size() - num_written);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // the fd is non-blocking, so wait until it can take more
+                pollfd p{fd, POLLOUT, 0};
+                poll(&p, 1, -1);
+                continue;
+            }
+            throw std::runtime_error(std::string("Could not write to fd: ") + strerror(errno));
+        }
+        num_written += count;
+    }
+}
 }
 
 void Session::_read_from_stdin() {
-    std::string s = read_from_fd(STDIN_FILENO);
+    // Only read as many keys as _pendingKeys has room for (each char is at
+    // most one key, and so is each char that the matcher is holding back).
+    // The rest wait in stdin until some of the pending keys have been dealt
+    // with, rather than being dropped.
+    auto space = _pendingKeys.space();
+    if (space <= kMaxKeyCodeLength) {
+        _watch_stdin_if_room();
+        return;
+    }
+    char buffer[4096];
+    ssize_t count;
+    do {
+        count = read(_in_fd, buffer, std::min(sizeof(buffer), space - kMaxKeyCodeLength));
+    } while (count < 0 && errno == EINTR);
+    runtime_assert(count >= 0, "There was a problem reading from stdin.");
+    if (count == 0) {
+        BOOST_LOG_TRIVIAL(debug) << "stdin was closed.";
+        _quit_early();
+    }
+    auto arrived = std::chrono::steady_clock::now();
 
-    // there's nothing left in stdin, and s is not empty, so we can process s now
-    while ( ! s.empty()) {
-        auto match_n = multi_char_keys_match(s);
-        if (match_n == 0) {
-            // unrecognised.  so just peel off 1 char.
-            match_n = 1;
-        }
-        _pendingKeys.push_back(s.substr(0, match_n));
-        s = s.substr(match_n);
+    // if this ends part way through a multi-char key, the matcher holds that part back
+    // until either the rest of it arrives, or the key timeout expires.
+    _key_matcher.feed(std::string_view(buffer, count), [this, arrived] (std::string_view key) {
+        _pendingKeys.push(key, arrived);
+    });
+    _loop->cancelTimer(_key_timer);
+    if (_key_matcher.pending()) {
+        _key_timer = _loop->addTimer(std::chrono::steady_clock::now() + _key_timeout, [this] {
+            // nothing more arrived in time, so whatever was held back is a key (or keys) on its own
+            auto arrived = std::chrono::steady_clock::now();
+            _key_matcher.flush([this, arrived] (std::string_view key) {
+                _pendingKeys.push(key, arrived);
+            });
+        });
     }
+    _watch_stdin_if_room();
 }
 
-std::string Session::_get_key_from_stdin() {
+void Session::_watch_stdin_if_room() {
+    // (while _pendingKeys is full, stdin would otherwise keep waking the loop up)
+    uint32_t events = 0;
+    if (_pendingKeys.space() > kMaxKeyCodeLength) {
+        events |= EventLoop::READABLE;
+    }
+    _loop->setFdEvents(_in_fd, events);
+}
+
+void Session::_pump_io(int timeout_ms) {
+    // everything (stdin, the pty, timers and signals) is waited for in one
+    // place, and handled by the callbacks that were registered in init():
+    // stdin gets chopped up and put into _pendingKeys, and pty output gets
+    // sent to stdout.
+    _watch_stdin_if_room();
+    _loop->runOnce(timeout_ms);
+}
+
+KeyToken Session::_get_key_from_stdin() {
 
     _updateMonitor();
 
     while (true) {
-
-        // instead of a blocking read on stdin, this is a
-        // blocking poll on stdin + _pty_fd.  then, when it returns,
-        // react according, ie. handle either or both which have input to read.
-        //
-        // if there was something from stdin, then proceed as we do here,
-        // ie. go ahead and use a non-blocking poll to make sure we consume
-        // everything available for stdin, then chop it up and put it into
-        // _pendingKeys.
-        //
-        // if there was something from the pty, then handle it accordingly,
-        // ie. read it and then send it to stdout.
-        //
-        // finally, after doing either/both of these things, check if _pendingKeys
-        // has anything in it, and if so, return the first thing.
-
-        pollfd polls[2];
-        polls[0].fd = STDIN_FILENO;
-        polls[0].events = POLLIN;
-        polls[0].revents = 0;
-        polls[1].fd = _pty_fd;
-        polls[1].events = POLLIN;
-        polls[1].revents = 0;
-        // timeout should only be -1 if _pendingKeys.size() == 0.
+        // timeout should only be -1 if _pendingKeys is empty.
         // Otherwise, it should be 0 - this lets us still handle any pty output
         // (or any extra stdin for that matter), and then fall immediately through to
         // return the pendingkey.
-        int timeout = (_pendingKeys.size() == 0) ? -1 : 0;
-        int rc = poll(polls, 2, timeout);
-        if (rc < 0) {
-            throw std::runtime_error("There was a problem polling stdin.");
-        } else if (rc > 0) {
-            // Something happened
-            if (polls[0].revents & POLLERR) {
-                throw std::runtime_error("Error encountered while polling stdin.");
-            }
-            if (polls[1].revents & POLLERR) {
-                throw std::runtime_error("Error encountered while polling pty.");
-            }
-            if (polls[1].revents & POLLIN) {
-                // There is data to read from the pty.
-                _process_pty_output();
+        _pump_io(_pendingKeys.empty() ? -1 : 0);
+
+        if ( ! _pendingKeys.empty()) {
+            auto key = _pendingKeys.pop();
+            _key_arrived = key.arrived();
+            return key;
+        }
+    }
+}
+
+void Session::_handle_keys_while_waiting() {
+    // Ctrl-C and Ctrl-\ take effect wherever they are in the queue: some
+    // waits have no deadline, so they mustn't get stuck behind an ordinary
+    // key that is waiting for the next command to read it.
+    for (size_t i = 0; i < _pendingKeys.size(); i++) {
+        auto key = _pendingKeys.at(i);
+        int signo = 0;
+        if (_input_mode == UserInputMode::INSERT) {
+            auto action = _insert_keys.get(key);
+            signo = (action == Mode::Insert::Actions::SigInt) ? SIGINT : (action == Mode::Insert::Actions::SigQuit) ? SIGQUIT : 0;
+        } else if (_input_mode == UserInputMode::COMMAND) {
+            auto action = _command_keys.get(key);
+            signo = (action == Mode::Command::Actions::SigInt) ? SIGINT : (action == Mode::Command::Actions::SigQuit) ? SIGQUIT : 0;
+        } else if (_input_mode == UserInputMode::AUTO) {
+            auto action = _auto_keys.get(key);
+            signo = (action == Mode::Auto::Actions::SigInt) ? SIGINT : (action == Mode::Auto::Actions::SigQuit) ? SIGQUIT : 0;
+        }
+        // (in passthrough mode, every key belongs to the pty)
+        if (signo != 0) {
+            kill(0, signo);
+            throw exception::early_exit();
+        }
+    }
+
+    // The other keys that need attention right away are handled in order.
+    // As soon as there is a key that isn't one of those, stop, and leave it
+    // (and everything after it) for whatever command reads input next.
+    while ( ! _pendingKeys.empty()) {
+        auto key = _pendingKeys.peek();
+
+        if (_input_mode == UserInputMode::INSERT) {
+            auto action = _insert_keys.get(key);
+            if (action == Mode::Insert::Actions::SwitchToCommandMode) {
+                _input_mode = UserInputMode::COMMAND;
+                _updateMonitor();
+            } else {
+                return;
+            }
+
+        } else if (_input_mode == UserInputMode::COMMAND) {
+            auto action = _command_keys.get(key);
+            if (action == Mode::Command::Actions::Quit) {
+                _quit_early();
+            } else {
+                return;
             }
-            if (polls[0].revents & POLLIN) {
-                // There is data to read from stdin.
-                _read_from_stdin();
+
+        } else if (_input_mode == UserInputMode::AUTO) {
+            auto action = _auto_keys.get(key);
+            if (action == Mode::Auto::Actions::SwitchToCommandMode) {
+                _input_mode = UserInputMode::COMMAND;
+                _updateMonitor();
+            } else {
+                return;
             }
+
+        } else {
+            // in passthrough mode, every key belongs to the pty
+            return;
         }
 
-        if (_pendingKeys.size() > 0) {
-            auto key = _pendingKeys.front();
-            _pendingKeys.pop_front();
-            return key;
+        _pendingKeys.pop();
+    }
+}
+
+void Session::_wait_until(std::chrono::steady_clock::time_point deadline, const std::function<bool()>& done) {
+    while ( ! done()) {
+        _handle_keys_while_waiting();
+        if (deadline == std::chrono::steady_clock::time_point::max()) {
+            _pump_io(-1);
+            continue;
+        }
+        auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (remaining.count() <= 0) {
+            return;
+        }
+        _pump_io(remaining.count());
+    }
+}
+
+void Session::_start_job(const std::string& name, const std::string& command, const std::string& out_filename, const std::string& err_filename) {
+    auto& job = _jobs[name];
+    if (job && job->running()) {
+        throw std::runtime_error("Job " + name + " is already running.");
+    }
+    job = std::make_unique<Job>(name, command, out_filename, err_filename);
+}
+
+void Session::_wait_for_job(const std::string& name) {
+    auto it = _jobs.find(name);
+    runtime_assert(it != _jobs.end(), "Job " + name + " was never started.");
+    auto& job = *it->second;
+    // (the job may have finished before SIGCHLD was being watched for)
+    job.reap();
+    _wait_until(std::chrono::steady_clock::time_point::max(), [&job] { return ! job.running(); });
+}
+
+void Session::_wait_for_output(OutputMatcher matcher, const std::string& pattern) {
+    // while this is set, all output from the shown pty goes through
+    // _send_to_stdout (rather than being spliced), which feeds it to the
+    // matcher if it's the active pty (otherwise _drain_pty does).
+    _output_matcher.emplace(std::move(matcher));
+    auto deadline = (_wait_timeout.count() > 0) ? std::chrono::steady_clock::now() + _wait_timeout : std::chrono::steady_clock::time_point::max();
+    _wait_until(deadline, [this] { return _output_matcher->matched(); });
+    if ( ! _output_matcher->matched()) {
+        BOOST_LOG_TRIVIAL(warning) << "Timed out waiting for output: " << pattern;
+    }
+    _output_matcher.reset();
+}
+
+void Session::_reap_jobs() {
+    for (auto& [name, job] : _jobs) {
+        job->reap();
+    }
+}
+
+void Session::_open_pty(const std::string& name, const std::string& command) {
+    auto& pty = _ptys[name];
+    if (pty && ! pty->closed) {
+        // (eg. seeking back to before pty_open)
+        BOOST_LOG_TRIVIAL(debug) << "Pty " << name << " is already open.";
+        return;
+    }
+
+    std::vector<std::string> argv;
+    if (command.empty()) {
+        argv.push_back(_shell);
+        argv.insert(argv.end(), _shell_args.begin(), _shell_args.end());
+    } else {
+        argv = {"/bin/sh", "-c", command};
+    }
+    auto previous = pty.get();
+    pty = std::make_unique<Pty>(name, argv, ".gupty-pty-" + name + ".out");
+    // once there's more than one pty, any of them might not be shown, so the
+    // main one is logged too
+    if (auto& main = *_ptys[kMainPtyName]; ! main.logging()) {
+        main.openLog(std::string(".gupty-pty-") + kMainPtyName + ".out");
+    }
+    pty->resize(_get_window_size());
+    if (_shown == previous) {
+        _shown = pty.get();
+    }
+    if (_active == previous) {
+        _active = pty.get();
+    }
+    _watch_pty(*pty);
+}
+
+void Session::_watch_pty(Pty& pty) {
+    pty.events = EventLoop::READABLE;
+    _loop->watchFd(pty.fd(), pty.events, [this, &pty] (uint32_t events) {
+        if (events & EventLoop::ERROR) {
+            throw std::runtime_error("Error encountered while polling pty " + pty.name() + ".");
+        }
+        if (events & EventLoop::WRITABLE) {
+            _flush_pty_input(pty);
+        }
+        // (a hangup means the child has gone away, which reading will notice)
+        if (events & (EventLoop::READABLE | EventLoop::HANGUP)) {
+            if (&pty == _shown) {
+                _process_pty_output();
+            } else {
+                _drain_pty(pty);
+            }
+        }
+    });
+}
+
+Pty* Session::_find_pty(const std::string& name) {
+    auto it = _ptys.find(name);
+    if (it == _ptys.end()) {
+        BOOST_LOG_TRIVIAL(warning) << "Pty " << name << " isn't open.";
+        return nullptr;
+    }
+    return it->second.get();
+}
+
+void Session::_use_pty(Pty& pty) {
+    _active = &pty;
+    if (&pty == _shown) {
+        return;
+    }
+
+    // whatever is still buffered was from the pty being switched away from
+    if (_frame_interval.count() > 0) {
+        _send_frame();
+    } else {
+        _send_to_stdout(_pty_output);
+    }
+    if (_output_mode == OutputMode::FILTERED) {
+        _flush_output_filter();
+    }
+
+    auto previous = _shown;
+    _shown = &pty;
+    _update_pty_events(*previous);
+    _update_pty_events(pty);
+}
+
+void Session::_drain_pty(Pty& pty) {
+    char buffer[16 * 1024];
+    bool match = _output_matcher && &pty == _active;
+    for (int i = 0; i < kMaxFrameReads; i++) {
+        auto count = read(pty.fd(), buffer, sizeof(buffer));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (count < 0 && errno != EIO) {
+            throw std::runtime_error("There was a problem reading from pty " + pty.name() + ".");
+        }
+        if (count <= 0) {
+            _close_pty(pty);
+            return;
         }
+
+        std::string_view data(buffer, count);
+        if (match) {
+            _output_matcher->feed(data);
+        }
+        if (_bracketed_paste_mode == BracketedPasteMode::AUTO) {
+            _watch_for_bracketed_paste(pty, data);
+        }
+        pty.log(data);
     }
 }
 
-void Session::_send_to_stdout(const std::string& s) {
+void Session::_close_pty(Pty& pty) {
+    BOOST_LOG_TRIVIAL(debug) << "Child closed pty " << pty.name() << ".";
+    pty.closed = true;
+    pty.input.clear();
+    _loop->unwatchFd(pty.fd());
+    if (pty.name() == kMainPtyName) {
+        _quit();
+    }
+    // the rest of the script carries on without it (and can open it again)
+    BOOST_LOG_TRIVIAL(info) << "Pty " << pty.name() << " has exited.";
+}
+
+void Session::_send_to_stdout(RingBuffer& buffer) {
+    // (the output being waited for might be from another pty, see _drain_pty)
+    bool match = _output_matcher && _shown == _active;
+    bool watch_bracketed_paste = (_bracketed_paste_mode == BracketedPasteMode::AUTO);
+    if (match || (_recorder && _output_mode == OutputMode::ALL) || watch_bracketed_paste || _shown->logging()) {
+        iovec iov[2];
+        auto n = buffer.data(iov);
+        for (int i = 0; i < n; i++) {
+            std::string_view data(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+            if (match) {
+                _output_matcher->feed(data);
+            }
+            if (watch_bracketed_paste) {
+                _watch_for_bracketed_paste(*_shown, data);
+            }
+            _shown->log(data);
+            if (_recorder && _output_mode == OutputMode::ALL) {
+                _recorder->output(data);
+            }
+        }
+    }
+
     if (_output_mode == OutputMode::ALL) {
-        write_to_fd(STDOUT_FILENO, s);
+        while ( ! buffer.empty()) {
+            runtime_assert(buffer.writeTo(_out_fd) >= 0, "Could not write to stdout.");
+        }
 
     } else if (_output_mode == OutputMode::NONE) {
+        buffer.clear();
+
+    } else {
+        _filtered_output.clear();
+        iovec iov[2];
+        auto n = buffer.data(iov);
+        for (int i = 0; i < n; i++) {
+            _output_filter.feed(std::string_view(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len), _filtered_output);
+        }
+        buffer.clear();
+        _write_to_stdout(_filtered_output);
+
+        // if the rest of a line doesn't turn up soon, show what there is of it
+        // (other than anything that might be the start of a secret)
+        _loop->cancelTimer(_filter_timer);
+        if (_output_filter.pending()) {
+            _filter_timer = _loop->addTimer(std::chrono::steady_clock::now() + kFilterFlushDelay, [this] {
+                _filter_timer = 0;
+                _filtered_output.clear();
+                _output_filter.flushPartial(_filtered_output);
+                _write_to_stdout(_filtered_output);
+            });
+        }
+    }
+}
+
+void Session::_flush_output_filter() {
+    _loop->cancelTimer(_filter_timer);
+    _filtered_output.clear();
+    _output_filter.flush(_filtered_output);
+    _write_to_stdout(_filtered_output);
+}
 
-    } else  {
-        // FIXME: handle output filtering...?
+void Session::_write_to_stdout(std::string_view s) {
+    if (s.empty()) {
+        return;
+    }
+    if (_recorder) {
+        _recorder->output(s);
     }
+    write_to_fd(_out_fd, s);
 }
 
-std::string Session::_get_from_pty() {
-    // output of pty is read from pty fd
-    return read_from_fd(_pty_fd);
+bool Session::_read_from_pty() {
+    // output of pty is read from pty fd, straight into the ring buffer
+    auto count = _pty_output.readFrom(_shown->fd());
+    if (count == 0 && _pty_output.saturated()) {
+        return true;
+    }
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return false;
+    }
+    if (count < 0 && errno != EIO) {
+        throw std::runtime_error("There was a problem reading from the pty.");
+    }
+    if (count <= 0) {
+        // EOF or EIO means that the child has closed its end of the pty (ie. exited).
+        BOOST_LOG_TRIVIAL(debug) << "Child closed the pty.";
+        if (_frame_interval.count() > 0) {
+            _send_frame();
+        } else {
+            _send_to_stdout(_pty_output);
+        }
+        if (_output_mode == OutputMode::FILTERED) {
+            _flush_output_filter();
+        }
+        _close_pty(*_shown);
+        return false;
+    }
+    return true;
 }
 
-// Since we need to mutate the string (to change \n to \r),
-// we may as well just pass it in by value anyway.
-void Session::_send_to_pty(std::string s) {
-    std::transform(s.begin(), s.end(), s.begin(), [] (const char& ch) {
+#ifdef __linux__
+// Moves available pty output to stdout through a pipe, so that the bytes are
+// never copied into userspace.  Returns the number of bytes moved (which may
+// have ended up in _pty_output instead, if stdout turned out not to support
+// splicing), 0 if there was nothing to read, or -1 if the caller should fall
+// back to reading into _pty_output.
+ssize_t Session::_splice_pty_output() {
+    constexpr size_t kSpliceChunk = 64 * 1024;
+
+    if ( ! _splice_enabled || _output_mode != OutputMode::ALL || _output_matcher || _recorder || ! _pty_output.empty() || _frame_interval.count() > 0
+            || _bracketed_paste_mode == BracketedPasteMode::AUTO || _shown->logging()) {
+        return -1;
+    }
+    if (_splice_pipe[0] < 0 && pipe2(_splice_pipe, O_CLOEXEC) != 0) {
+        BOOST_LOG_TRIVIAL(debug) << "Could not create splice pipe, disabling splice: " << strerror(errno);
+        _splice_enabled = false;
+        return -1;
+    }
+
+    auto in = splice(_shown->fd(), nullptr, _splice_pipe[1], nullptr, kSpliceChunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (in < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        if (errno != EIO && errno != EINTR) {
+            // the kernel can't splice from this pty
+            BOOST_LOG_TRIVIAL(debug) << "Could not splice from pty, disabling splice: " << strerror(errno);
+            _splice_enabled = false;
+        }
+        return -1;
+    }
+    if (in == 0) {
+        return -1;
+    }
+
+    size_t pending = in;
+    while (pending > 0) {
+        auto out = splice(_splice_pipe[0], nullptr, _out_fd, nullptr, pending, SPLICE_F_MOVE);
+        if (out < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // stdout can't be spliced to, so rescue whatever is still in the pipe
+            // and let the ring buffer deal with it (and everything after it).
+            BOOST_LOG_TRIVIAL(debug) << "Could not splice to stdout, disabling splice: " << strerror(errno);
+            _splice_enabled = false;
+            while (pending > 0) {
+                auto count = _pty_output.readFrom(_splice_pipe[0]);
+                runtime_assert(count > 0, "Could not read from splice pipe.");
+                pending -= count;
+            }
+            return in;
+        }
+        pending -= out;
+    }
+    return in;
+}
+#endif
+
+void Session::_send_to_pty(std::string_view s) {
+    // we need to change \n to \r, so do that into a buffer that is reused
+    // (to avoid allocating on every key).
+    _pty_send_buffer.assign(s);
+    std::transform(_pty_send_buffer.begin(), _pty_send_buffer.end(), _pty_send_buffer.begin(), [] (const char& ch) {
         return ch == '\n' ? '\r' : ch;
     });
-    // It's possible that some programs might not like getting lots of
-    // "typed input" all at once.  So it might be good to have an option
-    // to specify some delay between each key sent to the pty (even when
-    // "pasting").
-    write_to_fd(_pty_fd, s);
+    // (programs which don't like getting lots of input all at once can be
+    // given pastes more gently, see _paste.)
+
+    auto& pty = *_active;
+    if (pty.closed) {
+        BOOST_LOG_TRIVIAL(debug) << "Pty " << pty.name() << " has exited, discarding " << _pty_send_buffer.size() << " bytes of input.";
+        return;
+    }
+
+    // Never block writing to the pty: the child might be blocked writing
+    // output, waiting for us to read it.  Instead, queue it up, and keep the
+    // output flowing until the child has read enough to make room.
+    if (pty.input.size() + _pty_send_buffer.size() > kMaxPtyInput) {
+        _wait_until(std::chrono::steady_clock::time_point::max(), [this, &pty] {
+            return pty.input.empty() || pty.input.size() + _pty_send_buffer.size() <= kMaxPtyInput;
+        });
+    }
+    pty.input.append(_pty_send_buffer.data(), _pty_send_buffer.size());
+    _flush_pty_input(pty);
+    if (_key_arrived) {
+        _key_latency.record(std::chrono::steady_clock::now() - *_key_arrived);
+        _key_arrived.reset();
+    }
+}
+
+void Session::_paste(std::string_view text) {
+    auto& pty = *_active;
+    bool bracketed = (_bracketed_paste_mode == BracketedPasteMode::ON)
+        || (_bracketed_paste_mode == BracketedPasteMode::AUTO && pty.bracketed_paste);
+    if (bracketed) {
+        // the child knows it is being pasted to, so it can take it all at once
+        _send_to_pty(std::string(CODE_PasteStart) + std::string(text) + CODE_PasteEnd);
+        return;
+    }
+    if (_paste_chunk_size == 0 || text.size() <= _paste_chunk_size) {
+        _send_to_pty(text);
+        return;
+    }
+
+    size_t pos = 0;
+    while (pos < text.size()) {
+        auto n = std::min(_paste_chunk_size, text.size() - pos);
+        // don't split a UTF-8 character between chunks
+        while (n > 1 && pos + n < text.size() && (static_cast<unsigned char>(text[pos + n]) & 0xc0) == 0x80) {
+            n--;
+        }
+        _send_to_pty(text.substr(pos, n));
+        pos += n;
+        if (pos < text.size()) {
+            // wait until the child has taken this chunk (and then some), with
+            // output still being shown, and eg. Ctrl-C still working
+            _wait_until(std::chrono::steady_clock::time_point::max(), [&pty] { return pty.input.empty(); });
+            _wait_until(std::chrono::steady_clock::now() + _paste_delay, [] { return false; });
+        }
+    }
+}
+
+void Session::_watch_for_bracketed_paste(Pty& pty, std::string_view data) {
+    // CODE_BracketedPasteOn and Off only differ in their last byte
+    constexpr std::string_view prefix(CODE_BracketedPasteOn, std::char_traits<char>::length(CODE_BracketedPasteOn) - 1);
+    for (char ch : data) {
+        if (pty.bracketed_paste_matched == prefix.size()) {
+            if (ch == CODE_BracketedPasteOn[prefix.size()]) {
+                pty.bracketed_paste = true;
+            } else if (ch == CODE_BracketedPasteOff[prefix.size()]) {
+                pty.bracketed_paste = false;
+            }
+            pty.bracketed_paste_matched = 0;
+        }
+        if (ch == prefix[pty.bracketed_paste_matched]) {
+            pty.bracketed_paste_matched++;
+        } else {
+            pty.bracketed_paste_matched = (ch == prefix[0]) ? 1 : 0;
+        }
+    }
+}
+
+void Session::_flush_pty_input(Pty& pty) {
+    while ( ! pty.input.empty()) {
+        ssize_t count = 0;
+        errno_assert((count = pty.input.writeTo(pty.fd())) >= 0 || errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK || errno == EIO,
+                "Could not write to the pty");
+        if (count >= 0 || errno == EINTR) {
+            continue;
+        }
+        if (errno == EIO) {
+            // the child has gone away (which reading from the pty will notice)
+            BOOST_LOG_TRIVIAL(debug) << "Child closed pty " << pty.name() << ", discarding " << pty.input.size() << " bytes of input.";
+            pty.input.clear();
+        }
+        break;
+    }
+    _update_pty_events(pty);
+}
+
+void Session::_update_pty_events(Pty& pty) {
+    if (pty.closed) {
+        return;
+    }
+    // (only the shown pty is held back by the frames)
+    bool paused = _pty_paused && &pty == _shown;
+    uint32_t events = 0;
+    if ( ! paused) {
+        events |= EventLoop::READABLE;
+    }
+    if ( ! pty.input.empty()) {
+        events |= EventLoop::WRITABLE;
+    }
+    if (events != pty.events) {
+        _loop->setFdEvents(pty.fd(), events);
+        pty.events = events;
+    }
 }
 
 void Session::_process_user_input(bool permit_backspace) {
@@ -808,6 +1988,10 @@ void Session::_process_user_input(bool permit_backspace) {
                 } else if (action == Mode::Command::Actions::ResizeWindow) {
                     _sync_window_size();
 
+                } else if (action == Mode::Command::Actions::ShowLatency) {
+                    // (shown by the _updateMonitor() for the next key)
+                    _latency_shown++;
+
                 } else if (action == Mode::Command::Actions::SwitchToInsertMode) {
                     _input_mode = UserInputMode::INSERT;
                     cont = true;
@@ -837,10 +2021,33 @@ void Session::_process_user_input(bool permit_backspace) {
                     }
 
                 } else if (action == Mode::Command::Actions::NextLine) {
-                    // FIXME: implement?
+                    if (_current_command != _commands.end()) {
+                        _seek(_current_command - _commands.begin() + 1);
+                    }
 
                 } else if (action == Mode::Command::Actions::PrevLine) {
-                    // FIXME: implement?
+                    if (_current_command != _commands.begin()) {
+                        _seek(_current_command - _commands.begin() - 1);
+                    }
+
+                } else if (action == Mode::Command::Actions::NextSection) {
+                    // the first label after the current command (if any)
+                    auto current = static_cast<size_t>(_current_command - _commands.begin());
+                    if (current < _commands.size() && _labels_before[current + 1] < _sections.size()) {
+                        _seek(_sections[_labels_before[current + 1]]);
+                    }
+
+                } else if (action == Mode::Command::Actions::PrevSection) {
+                    // the last label before the current command (if any)
+                    auto current = static_cast<size_t>(_current_command - _commands.begin());
+                    if (_labels_before[current] > 0) {
+                        _seek(_sections[_labels_before[current] - 1]);
+                    }
+
+                } else if (action == Mode::Command::Actions::JumpToLabel) {
+                    if (auto index = _read_label()) {
+                        _seek(*index);
+                    }
 
                 } else if (action == Mode::Command::Actions::Return) {
                     break;
@@ -943,76 +2150,287 @@ void Session::_process_user_input(bool permit_backspace) {
 
 
         } else if (_input_mode == UserInputMode::AUTO) {
-            fd_set fds;
-            FD_ZERO(&fds);
-            FD_SET(STDIN_FILENO, &fds);
-
-            timeval timeout;
-            timeout.tv_sec  = 0;
-            timeout.tv_usec = 0;
-
-            int rc;
-
-            rc = select(1, &fds, NULL, NULL, &timeout);
-            if (rc < 0) {
-                throw std::runtime_error("There was a problem polling stdin fd.");
+            // In semi-auto mode, the user still has to press Enter at the end
+            // of each line.
+            bool waiting_for_user = _auto_paused || (_auto_pilot_mode == AutoPilotMode::SEMI && _line_status == LineStatus::LOADED);
+
+            // wait for a key, or until it's time to type the next one,
+            // whichever comes first (either way, output keeps being relayed).
+            _auto_due = false;
+            if ( ! waiting_for_user) {
+                _auto_timer = _loop->addTimer(std::chrono::steady_clock::now() + _auto_delay(), [this] {
+                    _auto_due = true;
+                });
             }
+            _wait_until(std::chrono::steady_clock::time_point::max(), [this] {
+                return _auto_due || ! _pendingKeys.empty() || _input_mode != UserInputMode::AUTO;
+            });
+            _loop->cancelTimer(_auto_timer);
 
-            // if we are in semi-auto mode and a line has been
-            // loaded, then we need to wait for user input
-            if (_auto_pilot_mode == AutoPilotMode::SEMI && _line_status == LineStatus::LOADED) {
+            if (_input_mode != UserInputMode::AUTO) {
+                // (eg. ESC was pressed while waiting)
                 cont = true;
+                continue;
+            }
+            if (_pendingKeys.empty()) {
+                // time to type the next key
+                break;
             }
 
-            if (rc > 0) {
-                // Since this is auto mode, only read from stdin if there is actually anything there to read.
-                // Otherwise we'll block.
+            // any key other than Enter (while waiting for it) just changes
+            // how the autopilot carries on.
+            cont = true;
+            auto key = _get_key_from_stdin();
+            auto action = _auto_keys.get(key);
 
-                auto key = _get_key_from_stdin();
-                auto action = _auto_keys.get(key);
+            if (action == Mode::Auto::Actions::SigInt) {
+                // if the user presses Ctl-C, we need to send SIGINT to everybody in
+                // our process group
+                kill(0, SIGINT);
+                throw exception::early_exit();
 
-                if (action == Mode::Auto::Actions::SigInt) {
-                    // if the user presses Ctl-C, we need to send SIGINT to everybody in
-                    // our process group
-                    kill(0, SIGINT);
-                    throw exception::early_exit();
+            } else if (action == Mode::Auto::Actions::SigQuit) {
+                // Ctl-\, which means quit
+                kill(0, SIGQUIT);
+                throw exception::early_exit();
 
-                } else if (action == Mode::Auto::Actions::SigQuit) {
-                    // Ctl-\, which means quit
-                    kill(0, SIGQUIT);
-                    throw exception::early_exit();
+            } else if (action == Mode::Auto::Actions::SwitchToCommandMode) {
+                _input_mode = UserInputMode::COMMAND;
 
-                } else if (action == Mode::Auto::Actions::SwitchToCommandMode) {
-                    _input_mode = UserInputMode::COMMAND;
+            } else if (action == Mode::Auto::Actions::SwitchToFullAuto) {
+                _auto_pilot_mode = AutoPilotMode::FULL;
 
-                } else if (action == Mode::Auto::Actions::SwitchToFullAuto) {
-                    _auto_pilot_mode = AutoPilotMode::FULL;
+            } else if (action == Mode::Auto::Actions::SwitchToSemiAuto) {
+                _auto_pilot_mode = AutoPilotMode::SEMI;
 
-                } else if (action == Mode::Auto::Actions::SwitchToSemiAuto) {
-                    _auto_pilot_mode = AutoPilotMode::SEMI;
+            } else if (action == Mode::Auto::Actions::Faster) {
+                _auto_speed = std::min(_auto_speed * 2, kMaxAutoSpeed);
 
-                } else if (action == Mode::Auto::Actions::Return) {
-                    break;
-                }
+            } else if (action == Mode::Auto::Actions::Slower) {
+                _auto_speed = std::max(_auto_speed / 2, 1 / kMaxAutoSpeed);
+
+            } else if (action == Mode::Auto::Actions::TogglePause) {
+                _auto_paused = ! _auto_paused;
+
+            } else if (action == Mode::Auto::Actions::Return && waiting_for_user && ! _auto_paused) {
+                break;
             }
+        }
+    }
+}
 
-            std::this_thread::sleep_for(std::chrono::milliseconds(_auto_pilot_pause_milliseconds));
+std::chrono::steady_clock::duration Session::_auto_delay() {
+    double millis;
+    if (_line_status == LineStatus::LOADED) {
+        // (about to press Enter)
+        millis = _auto_enter_delay.count();
+    } else {
+        millis = _auto_key_delay.count();
+        if (_line_character_it != _line.end() && *_line_character_it == ' ') {
+            millis *= kAutoWordPause;
         }
     }
+    if (_auto_key_jitter > 0) {
+        // a log-normal distribution (with a median of 1) is a decent model
+        // of the gaps between key presses: mostly near the median, with the
+        // occasional long hesitation (which is capped).
+        std::lognormal_distribution<double> jitter(0.0, _auto_key_jitter / 100.0);
+        millis *= std::min(jitter(_auto_rng), 4.0);
+    }
+    return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(millis / _auto_speed));
 }
 
-void Session::_sync_window_size() {
+winsize Session::_get_window_size() {
     winsize window_size;
-    runtime_assert(ioctl(STDIN_FILENO, TIOCGWINSZ, &window_size) == 0, "Could not get current window size");
+    if (_window_size) {
+        window_size = *_window_size;
+    } else {
+        runtime_assert(ioctl(_in_fd, TIOCGWINSZ, &window_size) == 0, "Could not get current window size");
+    }
     BOOST_LOG_TRIVIAL(debug) << "got window_size of rows = " << window_size.ws_row << " cols = " << window_size.ws_col << " xpixel = " << window_size.ws_xpixel << " ypixel = " << window_size.ws_ypixel;
     runtime_assert(window_size.ws_row != 0, "window size rows is zero");
     runtime_assert(window_size.ws_col != 0, "window size cols is zero");
     window_size.ws_xpixel = 0;
     window_size.ws_ypixel = 0;
-    auto result = ioctl(_pty_fd, TIOCSWINSZ, &window_size);
-    auto set_errno = errno;
-    BOOST_LOG_TRIVIAL(debug) << "set window size result = " << result << " and errno " << set_errno << " " << strerror(set_errno);
-    //runtime_assert(result == 0, "Could not set pty window size");  // fails on macos, not sure why
+    return window_size;
+}
+
+winsize Session::_sync_window_size() {
+    auto window_size = _get_window_size();
+    for (auto& [name, pty] : _ptys) {
+        pty->resize(window_size);
+    }
+    if (_recorder) {
+        _recorder->resize(window_size.ws_col, window_size.ws_row);
+    }
+    return window_size;
+}
+
+void Session::_checkpoint() {
+    if ( ! _state_filename || _checkpoint_timer) {
+        // (a timer will save the latest position)
+        return;
+    }
+    auto due = _last_checkpoint + kCheckpointInterval;
+    if (std::chrono::steady_clock::now() >= due) {
+        _write_checkpoint();
+        return;
+    }
+    _checkpoint_timer = _loop->addTimer(due, [this] {
+        _checkpoint_timer = 0;
+        _write_checkpoint();
+    });
+}
+
+void Session::_write_checkpoint() {
+    if ( ! _state_filename || ! _checkpoints_started || _commands.empty()) {
+        return;
+    }
+    _last_checkpoint = std::chrono::steady_clock::now();
+    // (after quitting, resume in COMMAND mode, rather than not at all)
+    auto input_mode = (_input_mode == UserInputMode::QUITTING) ? UserInputMode::COMMAND : _input_mode;
+    writeCheckpoint(*_state_filename, {
+        _script_filename,
+        _sources_hash,
+        _commands.size(),
+        static_cast<size_t>(_current_command - _commands.begin()),
+        UserInputModeNames(input_mode),
+        OutputModeNames(_output_mode),
+    });
+}
+
+void Session::_resume_from_checkpoint() {
+    runtime_assert(_state_filename.has_value(), "There is no state file to resume from.");
+    auto checkpoint = readCheckpoint(*_state_filename);
+    runtime_assert(checkpoint.has_value(), "Could not read the state file: " + *_state_filename);
+    runtime_assert(checkpoint->script == _script_filename, "The state file is for a different script: " + checkpoint->script);
+    runtime_assert(checkpoint->sources_hash == _sources_hash && checkpoint->num_commands == _commands.size(),
+            "The script has changed since the state file was written.");
+    BOOST_LOG_TRIVIAL(info) << "Resuming from command " << (checkpoint->command + 1);
+
+    // (skips are followed, the same as when the script ran)
+    for (size_t i = 0; i < checkpoint->command; ) {
+        const auto& cmd = _commands[i];
+        if (cmd.op == Op::SKIP) {
+            i = cmd.value;
+            continue;
+        }
+        _current_command = _commands.begin() + i;
+        _updateMonitor();
+        _replay_setup_command(cmd);
+        i++;
+    }
+
+    _current_command = _commands.begin() + checkpoint->command;
+    auto input_mode = UserInputModeNames(checkpoint->input_mode);
+    _input_mode = (input_mode == UserInputMode::UNKNOWN || input_mode == UserInputMode::QUITTING) ? UserInputMode::COMMAND : input_mode;
+    if (auto output_mode = OutputModeNames(checkpoint->output_mode); output_mode != OutputMode::UNKNOWN) {
+        _output_mode = output_mode;
+    }
+}
+
+void Session::_replay_setup_command(const Command& cmd) {
+    // Settings are always replayed, since they don't send anything to the
+    // shell (and the rest of the script may well depend on them).
+    if (cmd.op == Op::OUTPUT || cmd.op == Op::WAIT_TIMEOUT
+            || cmd.op == Op::FILTER_REDACT || cmd.op == Op::FILTER_REDACT_REGEX || cmd.op == Op::FILTER_DROP_LINES
+            || cmd.op == Op::FILTER_STRIP_ESCAPES || cmd.op == Op::FILTER_CLEAR
+            || cmd.op == Op::PASTE_CHUNK_SIZE || cmd.op == Op::PASTE_DELAY || cmd.op == Op::PASTE_BRACKETED
+            || cmd.op == Op::AUTO_KEY_DELAY || cmd.op == Op::AUTO_KEY_JITTER || cmd.op == Op::AUTO_ENTER_DELAY) {
+        _commandFns[cmd.op](cmd);
+        return;
+    }
+    // and so are the ptys (which the setup commands may well be sent to)
+    if (cmd.op == Op::PTY_OPEN || cmd.op == Op::USE) {
+        _commandFns[cmd.op](cmd);
+        return;
+    }
+    if ( ! cmd.setup) {
+        return;
+    }
+
+    // Anything typed is pasted instead, and nothing waits for keys.
+    Command replay = cmd;
+    if (cmd.op == Op::TYPE_LINE) {
+        replay.op = Op::PASTE_LINE;
+    } else if (cmd.op == Op::TYPE) {
+        replay.op = Op::PASTE;
+    } else if (cmd.op == Op::TYPE_KEYS) {
+        replay.op = Op::PASTE_KEYS;
+    } else if (cmd.op == Op::WAIT_FOR_AND_SEND_ENTER) {
+        replay.op = Op::PASTE_KEYS;
+        replay.keys = {CODE_Enter};
+    } else if (cmd.op == Op::WAIT_FOR_ENTER || cmd.op == Op::WAIT_FOR_ANY_KEY || cmd.op == Op::PAUSE) {
+        return;
+    }
+    BOOST_LOG_TRIVIAL(debug) << "Replaying setup command: " << cmd.name << " " << cmd.arg;
+    _run_command(replay);
+}
+
+void Session::_run_command(const Command& cmd) {
+    if (cmd.target.empty() || ! opUsesPty(cmd.op)) {
+        _commandFns[cmd.op](cmd);
+        return;
+    }
+
+    auto pty = _find_pty(cmd.target);
+    if ( ! pty) {
+        return;
+    }
+    if (pty->closed) {
+        BOOST_LOG_TRIVIAL(warning) << "Pty " << cmd.target << " has exited, skipping: " << cmd.name << " " << cmd.arg;
+        return;
+    }
+    // (the command might be abandoned by a seek, or by quitting)
+    auto active = _active;
+    _active = pty;
+    try {
+        _commandFns[cmd.op](cmd);
+    } catch (...) {
+        _active = active;
+        throw;
+    }
+    _active = active;
+}
+
+std::optional<size_t> Session::_read_label() {
+    _label_prompt = "";
+    while (true) {
+        auto key = _get_key_from_stdin();
+        auto action = _command_keys.get(key);
+        if (action == Mode::Command::Actions::SigInt) {
+            kill(0, SIGINT);
+            throw exception::early_exit();
+        } else if (action == Mode::Command::Actions::SigQuit) {
+            kill(0, SIGQUIT);
+            throw exception::early_exit();
+        } else if (key.view() == "\033") {
+            break;
+        } else if (key.view() == CODE_Enter) {
+            if (auto it = _labels.find(*_label_prompt); it != _labels.end()) {
+                _label_prompt.reset();
+                return it->second;
+            }
+            BOOST_LOG_TRIVIAL(info) << "No such label: " << *_label_prompt;
+            _label_prompt = "";
+        } else if (key.view() == CODE_Backspace) {
+            if ( ! _label_prompt->empty()) {
+                _label_prompt->pop_back();
+            }
+        } else if (key.view().size() == 1 && std::isgraph(static_cast<unsigned char>(key.view()[0]))) {
+            *_label_prompt += key.view();
+        }
+    }
+    _label_prompt.reset();
+    _updateMonitor();
+    return std::nullopt;
+}
+
+void Session::_wait_for_enter() {
+    _line = "";
+    _line_character_it = _line.begin();
+    _line_status = LineStatus::LOADED;
+    _process_user_input();
 }
 
 void Session::_quit(bool early) {
@@ -16,30 +16,42 @@
 
 #pragma once
 
+#include <chrono>
 #include <string>
 #include <vector>
 #include <list>
 #include <map>
+#include <memory>
 #include <optional>
 #include <ostream>
+#include <random>
+#include <set>
+#include <unordered_map>
 
+#include <sys/ioctl.h>
 #include <termios.h>
-
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "command.h"
+#include "event_loop.h"
+#include "job.h"
+#include "key_ring.h"
+#include "keycodes.h"
+#include "latency_histogram.h"
 #include "libgupty.h"
 #include "lines.h"
 #include "mode_auto.h"
 #include "mode_command.h"
 #include "mode_insert.h"
 #include "mode_passthrough.h"
-
-struct Command {
-    std::string name;
-    std::string arg;
-};
-
-using Commands = std::vector<Command>;
-
-using CommandFn = std::function<void(const Command&)>;
+#include "monitor.h"
+#include "monitor_socket.h"
+#include "output_filter.h"
+#include "output_matcher.h"
+#include "pty.h"
+#include "recorder.h"
+#include "ring_buffer.h"
 
 class Session {
 public:
@@ -77,33 +89,168 @@ public:
     };
     static Enum<AutoPilotMode> AutoPilotModeNames;
 
+    enum class BracketedPasteMode {
+        OFF,
+        ON,
+        AUTO,
+        UNKNOWN,
+    };
+    static Enum<BracketedPasteMode> BracketedPasteModeNames;
+
 
     Session();
     ~Session();
 
     void setShell(const std::string& shell);
+    // How long to wait for the rest of a partially received multi-char key
+    // (eg. to tell a lone ESC apart from an arrow key).
+    void setKeyTimeout(int millis);
     void setMonitor(const std::string& monitor_filename);
     void setNoMonitor();
+    // Also publish the monitor to any number of viewers, on a Unix socket.
+    void setMonitorSocket(const std::string& path);
+    // Record everything shown on stdout to an asciicast file.
+    void setRecord(const std::string& record_filename);
+    // Save where the script has got up to in this file, every so often.
+    void setStateFile(const std::string& state_filename);
+    // Start from where the state file says the script had got up to (after
+    // replaying the setup commands before that point).
+    void setResume();
+    // Use these fds instead of stdin and stdout (eg. for testing).  If in_fd
+    // isn't a terminal, it is left alone (rather than put into raw mode).
+    void setIO(int in_fd, int out_fd);
+    // Use this window size, instead of the size of the in_fd terminal.
+    void setWindowSize(unsigned short rows, unsigned short cols);
+    // Write output to stdout at most this many times a second, coalescing
+    // everything that arrives in between (0 means write it as it arrives).
+    void setFrameRate(unsigned int fps);
+    // When output is written in frames, show at most this many bytes of each
+    // frame (the most recent ones), and skip the rest (0 means no limit).
+    void setFrameLimit(size_t bytes);
 
     void init();
+    // Parses and checks the script lines (and anything they include), and
+    // links each skip to the command after it.
     Commands resolveCommands(const Lines& lines);
+    // Loads and resolves a script file, using (and updating) the compiled
+    // cache file if one is given.
+    Commands loadScript(const std::string& filename, const std::string& cache_filename = "");
     void run(Commands commands);
 
 
 protected:
+    Commands _resolve_lines(const Lines& lines);
+    // Replaces each ${NAME} in the line with the value of the variable (see
+    // _scopes), and each $${ with ${.
+    std::string _substitute(const std::string& line);
+    // Returns the index of the end which closes the define or repeat block
+    // starting at lines[begin].
+    size_t _find_block_end(const Lines& lines, size_t begin) const;
+    // Resolves whatever depends on the whole script (eg. where each skip
+    // carries on from), so that none of it has to be searched for later.
+    void _link_commands(Commands& commands);
+    // Builds the label index for _commands.
+    void _index_commands();
+    // Abandons the current command, and carries on from command `index`.
+    [[noreturn]] void _seek(size_t index);
+    // Saves a checkpoint now, or (if one was saved recently) soon.
+    void _checkpoint();
+    void _write_checkpoint();
+    // Replays the setup commands (and the settings) from before the
+    // checkpoint, and carries on from there.
+    void _resume_from_checkpoint();
+    void _replay_setup_command(const Command& cmd);
+    // Runs a command (with its input going to the pty given by `on`, if any).
+    void _run_command(const Command& cmd);
+
+    // Reads a label name (shown in the monitor as it is typed), and returns
+    // the index of its command, or nothing if it's cancelled (with ESC).
+    std::optional<size_t> _read_label();
+
     void _updateMonitor();
+    void _draw_monitor();
+    // One line for each of the latency histograms.
+    std::vector<std::string> _latency_summary() const;
+    std::string _format_monitor_line(Commands::const_iterator it, size_t num_digits) const;
+    // Deals with output from the shown pty (see _shown).
     void _process_pty_output();
 
-    void _read_from_stdin();
-    std::string _get_key_from_stdin();
-    void _send_to_stdout(const std::string& s);
+    // Waits (up to timeout_ms, or forever if -1) for activity on stdin or the
+    // pty, and deals with it: pty output goes to stdout, and stdin is split
+    // into keys in _pendingKeys.
+    void _pump_io(int timeout_ms);
+    // Handles any pending keys which can't wait (eg. Ctrl-C, ESC) while a
+    // command is waiting for something other than user input.
+    void _handle_keys_while_waiting();
+    // Keeps the I/O going until done() returns true, or the deadline passes.
+    void _wait_until(std::chrono::steady_clock::time_point deadline, const std::function<bool()>& done);
+
+    // Starts a background job, replacing any finished job with the same name.
+    void _start_job(const std::string& name, const std::string& command, const std::string& out_filename, const std::string& err_filename);
+    // Keeps the I/O going until the named job has finished.
+    void _wait_for_job(const std::string& name);
+    void _reap_jobs();
+
+    // Starts a pty (or restarts it, if its child has exited), running the
+    // command (or, if there isn't one, the shell).
+    void _open_pty(const std::string& name, const std::string& command);
+    void _watch_pty(Pty& pty);
+    // Returns the named pty, or (with a warning) nullptr if it isn't open
+    // (eg. because pty_open was seeked past).
+    Pty* _find_pty(const std::string& name);
+    // Shows the pty's output on stdout from now on, and sends input to it.
+    void _use_pty(Pty& pty);
+    // Reads the output of a pty which isn't being shown (which goes to its
+    // log file, and to anything waiting for it).
+    void _drain_pty(Pty& pty);
+    // The child has closed its end of the pty (ie. exited).
+    void _close_pty(Pty& pty);
+    // Keeps the I/O going until the pty output (from now on) matches, or
+    // _wait_timeout passes.
+    void _wait_for_output(OutputMatcher matcher, const std::string& pattern);
 
-    std::string _get_from_pty();
-    void _send_to_pty(std::string s);
+    void _read_from_stdin();
+    // Stops watching stdin while _pendingKeys is full (and starts again once
+    // there is room).
+    void _watch_stdin_if_room();
+    KeyToken _get_key_from_stdin();
+    void _send_to_stdout(RingBuffer& buffer);
+    // Writes straight to stdout (and the recording), skipping the output mode.
+    void _write_to_stdout(std::string_view s);
+    // Sends whatever the output filter is holding back to stdout.
+    void _flush_output_filter();
+
+    // When output is written in frames: reads pty output into _pty_output,
+    // to be sent with the next frame.
+    void _buffer_pty_output();
+    void _send_frame();
+    // Throws away the oldest n bytes of _pty_output.
+    void _skip_pty_output(size_t n);
+
+    bool _read_from_pty();
+#ifdef __linux__
+    ssize_t _splice_pty_output();
+#endif
+    // Queues input for the pty, and writes as much of it as the pty will take
+    // (the rest is written by the event loop, as the child reads its input).
+    void _send_to_pty(std::string_view s);
+    void _flush_pty_input(Pty& pty);
+    void _update_pty_events(Pty& pty);
+    // Sends pasted text to the pty: in bracketed paste if the child wants it,
+    // otherwise (if asked to) a chunk at a time, keeping the I/O going in
+    // between.
+    void _paste(std::string_view text);
+    // Keeps track of whether the child has turned bracketed paste on.
+    void _watch_for_bracketed_paste(Pty& pty, std::string_view data);
 
     void _process_user_input(bool permit_backspace = true);
+    // How long the autopilot waits before typing the next key.
+    std::chrono::steady_clock::duration _auto_delay();
 
-    void _sync_window_size();
+    winsize _get_window_size();
+    winsize _sync_window_size();
+
+    void _wait_for_enter();
 
     void _quit(bool early = false);
     void _quit_early();
@@ -114,13 +261,63 @@ protected:
     OutputMode _output_mode = OutputMode::ALL;
     AutoPilotMode _auto_pilot_mode = AutoPilotMode::FULL;
 
-    int _pty_fd = -2;
-    char* _pty_device_name = NULL;
-    pid_t _child_pid = -2;
-
-    int _auto_pilot_pause_milliseconds = 100;
-
-    bool _skipping = false;
+    int _in_fd = STDIN_FILENO;
+    int _out_fd = STDOUT_FILENO;
+    bool _in_is_tty = false;
+    std::optional<winsize> _window_size;
+
+    std::unique_ptr<EventLoop> _loop;
+    EventLoop::TimerId _resize_timer = 0;
+
+    // The ptys, by name (the main one is started by init, and the rest by
+    // pty_open).  The session ends when the main one does.
+    std::map<std::string, std::unique_ptr<Pty>> _ptys;
+    // The pty whose output is shown on stdout.
+    Pty* _shown = nullptr;
+    // The pty that input is sent to, and whose output is waited for (the
+    // shown one, apart from during a command given a pty with `on`).
+    Pty* _active = nullptr;
+
+    // Reused for everything sent to the pty.
+    std::string _pty_send_buffer;
+
+    // Output from the shown pty, waiting to be sent to stdout.
+    RingBuffer _pty_output;
+#ifdef __linux__
+    // Pipe used to splice(2) pty output directly to stdout, when possible.
+    int _splice_pipe[2] = {-1, -1};
+    bool _splice_enabled = true;
+#endif
+
+    // How pastes are sent (see _paste).
+    size_t _paste_chunk_size = 0;
+    std::chrono::milliseconds _paste_delay{0};
+    // (whether each child has asked for bracketed paste is only watched for in AUTO)
+    BracketedPasteMode _bracketed_paste_mode = BracketedPasteMode::OFF;
+
+    // Output frames (see setFrameRate).
+    std::chrono::steady_clock::duration _frame_interval{0};
+    size_t _frame_limit = 0;
+    std::chrono::steady_clock::time_point _last_frame;
+    EventLoop::TimerId _frame_timer = 0;
+    bool _frame_pending = false;
+    // Bytes skipped since the last frame.
+    uint64_t _frame_skipped = 0;
+    // The shown pty isn't being read, until the next frame makes room.
+    bool _pty_paused = false;
+
+    // The autopilot (AUTO mode) types like a person: each delay is the
+    // configured one (divided by the speed), varied at random (log-normally,
+    // by about _auto_key_jitter percent).
+    std::chrono::milliseconds _auto_key_delay{100};
+    std::chrono::milliseconds _auto_enter_delay{800};
+    unsigned int _auto_key_jitter = 40;
+    double _auto_speed = 1.0;
+    bool _auto_paused = false;
+    std::mt19937 _auto_rng{std::random_device{}()};
+    EventLoop::TimerId _auto_timer = 0;
+    // Set by _auto_timer, when it's time to type the next key.
+    bool _auto_due = false;
 
     termios _orig_terminal_settings;
 
@@ -140,16 +337,120 @@ protected:
 
     Commands _commands;
     Commands::iterator _current_command;
-
-    std::map<std::string,CommandFn> _commandFns;
+    // Bumped whenever _commands changes (so that anything cached from them,
+    // eg. the monitor lines, can tell that it's stale).
+    uint64_t _commands_generation = 0;
+
+    // The index of each label command, by name.
+    std::unordered_map<std::string, size_t> _labels;
+    // The indexes of all the label commands, in order.
+    std::vector<size_t> _sections;
+    // How many label commands come before each command (and one extra entry
+    // for the end), so that the next and previous sections are found
+    // straight away.
+    std::vector<size_t> _labels_before;
+    // The label name typed so far, while jumping to a label.
+    std::optional<std::string> _label_prompt;
+
+    EnumTable<Op, CommandFn, Op::UNKNOWN> _commandFns;
+
+    // The script and everything it includes, in the order they were loaded.
+    std::vector<std::string> _sources;
+    // Names of the jobs started by the script so far (while loading it).
+    std::set<std::string> _job_names;
+    // Likewise for just the ones started by setup commands (the only ones
+    // that are started again when resuming).
+    std::set<std::string> _setup_job_names;
+    // Likewise for the ptys opened by the script.
+    std::set<std::string> _pty_names;
+
+    struct Macro {
+        std::vector<std::string> params;
+        Lines body;
+    };
+    // Everything below is only used while loading the script.
+    std::map<std::string, Macro> _macros;
+    // Variables set by the script.
+    std::map<std::string, std::string> _variables;
+    // Macro arguments and repeat counters, innermost last (these hide
+    // _variables, which hide the environment).
+    std::vector<std::map<std::string, std::string>> _scopes;
+    // The environment variables that have been substituted (for the compiled
+    // cache, which is stale if any of them change).
+    std::map<std::string, std::string> _environment_used;
+
+    std::map<std::string, std::unique_ptr<Job>> _jobs;
+
+    // Only set while waiting for output.
+    std::optional<OutputMatcher> _output_matcher;
+    // How long to wait for output before giving up (0 is forever).
+    std::chrono::milliseconds _wait_timeout{30000};
+
+    // Used for output mode FILTERED (configured by the filter_* commands).
+    OutputFilter _output_filter;
+    // Reused for the output of the filter.
+    std::string _filtered_output;
+    EventLoop::TimerId _filter_timer = 0;
+
+    // The script that the commands were loaded from (by loadScript).
+    std::string _script_filename;
+    // The hash of _sources (as they were when loaded), so that resuming can
+    // tell whether any of them has changed since the checkpoint was written.
+    uint64_t _sources_hash = 0;
+    std::optional<std::string> _state_filename;
+    bool _resume = false;
+    // Only set once the commands are running (ie. after any resume has
+    // succeeded), so that a failed resume leaves the state file alone.
+    bool _checkpoints_started = false;
+    std::chrono::steady_clock::time_point _last_checkpoint;
+    EventLoop::TimerId _checkpoint_timer = 0;
+
+    std::optional<std::string> _record_filename;
+    std::unique_ptr<Recorder> _recorder;
 
     std::optional<std::string> _monitor_filename;
-    std::ostream* _monitor_file = nullptr;
+    std::unique_ptr<Monitor> _monitor;
+    std::optional<std::string> _monitor_socket_path;
+    std::unique_ptr<MonitorSocket> _monitor_socket;
     // FIXME: make this configurable
     unsigned int _monitor_num_pre_lines = 10;
     unsigned int _monitor_num_total_lines = 30;
 
-    std::list<std::string> _pendingKeys;
+    // Everything that can change what the monitor shows.
+    struct MonitorState {
+        UserInputMode input_mode;
+        size_t current_command;
+        size_t first_shown;
+        size_t total;
+        uint64_t commands_generation;
+        uint64_t latency_shown;
+        std::optional<std::string> label_prompt;
+
+        bool operator==(const MonitorState&) const = default;
+    };
+    std::optional<MonitorState> _monitor_state;
+    std::vector<std::string> _monitor_command_lines;
+    // The _commands_generation that _monitor_command_lines were built from.
+    std::optional<uint64_t> _monitor_command_lines_generation;
+    MonitorRows _monitor_rows;
+    // Bumped each time the latencies are asked for in COMMAND mode (so that
+    // they are redrawn), 0 when they aren't being shown.
+    uint64_t _latency_shown = 0;
+
+    // From a key arriving on stdin, to the first write to the pty after it
+    // was processed.
+    LatencyHistogram _key_latency;
+    // From the pty becoming readable, to its output having been sent to stdout.
+    LatencyHistogram _output_latency;
+    LatencyHistogram _monitor_latency;
+    // When the key currently being processed arrived (if it hasn't yet
+    // resulted in a write to the pty).
+    std::optional<std::chrono::steady_clock::time_point> _key_arrived;
+
+    KeyRing _pendingKeys;
+    KeyMatcher _key_matcher;
+    std::chrono::milliseconds _key_timeout{50};
+    EventLoop::TimerId _key_timer = 0;
 
 };
 
@@ -0,0 +1,223 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+// Runs each <name>.gupty script in the given directory in a headless Session,
+// with the keys from <name>.keys fed in through a socketpair, and compares
+// everything the session writes out with <name>.golden.
+//
+// In the .keys file, newlines are ignored, and \r, \n, \t, \e, \\ and \xNN
+// escapes can be used.
+//
+// If there is a <name>.state file, the script is resumed (--resume) from a
+// copy of it, with @SCRIPT@ standing for the script's filename.  Then any
+// error, and the state file as it was left, are added to the end of the
+// transcript.
+//
+// The "shell" is cat, so that the transcripts are the same everywhere (ie.
+// just the pty's echo of each line, and then cat's copy of it).  Scripts
+// should use wait_for_output (rather than pause) to wait for cat, so that the
+// transcript doesn't depend on timing.
+//
+// Usage: golden_test <dir> [--update]
+//   --update   (re)write the .golden files, instead of comparing with them
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/algorithm/string/replace.hpp>
+#include <boost/log/core.hpp>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "session.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// How long any one script is allowed to take (it should take milliseconds).
+constexpr unsigned int kTimeoutSeconds = 20;
+
+// (SOCK_CLOEXEC isn't available everywhere, eg. macOS)
+void make_socketpair(int (&fds)[2]) {
+    runtime_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "Could not create socketpair.");
+    for (auto fd : fds) {
+        errno_assert(fcntl(fd, F_SETFD, FD_CLOEXEC) == 0, "Could not set close-on-exec on socketpair.");
+    }
+}
+
+std::string read_file(const fs::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+std::string decode_keys(const std::string& s) {
+    std::string keys;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '\n') {
+            continue;
+        }
+        if (s[i] != '\\' || i + 1 == s.size()) {
+            keys += s[i];
+            continue;
+        }
+        switch (s[++i]) {
+            case 'r': keys += '\r'; break;
+            case 'n': keys += '\n'; break;
+            case 't': keys += '\t'; break;
+            case 'e': keys += '\033'; break;
+            case 'x': keys += static_cast<char>(std::stoi(s.substr(i + 1, 2), nullptr, 16)); i += 2; break;
+            default: keys += s[i]; break;
+        }
+    }
+    return keys;
+}
+
+// Shows a transcript with the control characters visible.
+std::string escaped(const std::string& s) {
+    std::ostringstream oss;
+    for (unsigned char ch : s) {
+        if (ch == '\n') {
+            oss << "\\n\n";
+        } else if (ch < 0x20 || ch == 0x7f) {
+            oss << "\\x" << std::hex << (ch >> 4) << (ch & 0xf) << std::dec;
+        } else {
+            oss << ch;
+        }
+    }
+    return oss.str();
+}
+
+std::string run_script(const fs::path& script, const std::string& keys, const std::optional<std::string>& state) {
+    auto state_path = fs::temp_directory_path() / ("gupty-golden-" + std::to_string(getpid()) + ".state");
+    if (state) {
+        std::ofstream(state_path, std::ios::binary) << boost::algorithm::replace_all_copy(*state, "@SCRIPT@", script.string());
+    }
+
+    int in[2];
+    int out[2];
+    // (close-on-exec, so that the shell doesn't keep the output open)
+    make_socketpair(in);
+    make_socketpair(out);
+
+    std::string transcript;
+    std::string error;
+    std::thread reader;
+    {
+        Session session;
+        session.setShell("/bin/cat");
+        session.setIO(in[1], out[1]);
+        session.setWindowSize(24, 80);
+        if (state) {
+            session.setStateFile(state_path.string());
+            session.setResume();
+        }
+        auto commands = session.loadScript(script.string());
+        session.init();
+
+        // only start the thread once the shell has been forked
+        reader = std::thread([&transcript, fd = out[0]] {
+            char buffer[4096];
+            ssize_t count;
+            while ((count = read(fd, buffer, sizeof(buffer))) > 0) {
+                transcript.append(buffer, count);
+            }
+        });
+        runtime_assert(write(in[0], keys.data(), keys.size()) == static_cast<ssize_t>(keys.size()), "Could not write keys.");
+
+        try {
+            session.run(commands);
+        } catch (const exception::normal_exit&) {
+        } catch (const std::runtime_error& e) {
+            error = e.what();
+        }
+    }
+
+    close(out[1]);
+    reader.join();
+    for (auto fd : {in[0], in[1], out[0]}) {
+        close(fd);
+    }
+
+    if ( ! error.empty()) {
+        transcript += "--- error: " + error + "\n";
+    }
+    if (state) {
+        transcript += "--- state file:\n";
+        transcript += boost::algorithm::replace_all_copy(read_file(state_path), script.string(), "@SCRIPT@");
+        fs::remove(state_path);
+    }
+    return transcript;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <dir> [--update]" << std::endl;
+        return 2;
+    }
+    fs::path dir = argv[1];
+    bool update = (argc > 2 && std::string(argv[2]) == "--update");
+
+    boost::log::core::get()->set_logging_enabled(false);
+    // a script that never finishes is a failure, not a hang
+    alarm(kTimeoutSeconds);
+
+    std::vector<fs::path> scripts;
+    for (const auto& entry : fs::directory_iterator(dir)) {
+        if (entry.path().extension() == ".gupty") {
+            scripts.push_back(entry.path());
+        }
+    }
+    std::sort(scripts.begin(), scripts.end());
+
+    int failures = 0;
+    for (const auto& script : scripts) {
+        auto keys_path = fs::path(script).replace_extension(".keys");
+        auto golden_path = fs::path(script).replace_extension(".golden");
+        auto state_path = fs::path(script).replace_extension(".state");
+        std::optional<std::string> state;
+        if (fs::exists(state_path)) {
+            state = read_file(state_path);
+        }
+        auto transcript = run_script(script, decode_keys(read_file(keys_path)), state);
+
+        if (update) {
+            std::ofstream(golden_path, std::ios::binary) << transcript;
+            std::cout << "updated " << golden_path.string() << std::endl;
+        } else if (transcript == read_file(golden_path)) {
+            std::cout << "ok      " << script.filename().string() << std::endl;
+        } else {
+            std::cout << "FAILED  " << script.filename().string() << std::endl;
+            std::cout << "--- expected:" << std::endl << escaped(read_file(golden_path)) << std::endl;
+            std::cout << "--- actual:" << std::endl << escaped(transcript) << std::endl;
+            failures++;
+        }
+    }
+    return failures ? 1 : 0;
+}
+
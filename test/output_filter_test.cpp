@@ -0,0 +1,89 @@
+/*
+ * Copyright 2023, MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the “License”);
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+// Checks what OutputFilter shows of lines that arrive in pieces: that what it
+// safely can is shown when it is flushed part way through a line (eg. a
+// prompt), and that a secret split across reads is still redacted.
+//
+// Usage: output_filter_test
+
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "output_filter.h"
+
+namespace {
+
+struct Case {
+    const char* name;
+    std::function<void(OutputFilter&)> configure;
+    // The chunks of output, with an empty one for an idle flush (flushPartial).
+    std::vector<std::string> chunks;
+    // What is shown after each chunk.
+    std::vector<std::string> expected;
+};
+
+const std::string kLongPrefix(OutputFilter::kMaxLineLength - 3, 'a');
+
+const std::vector<Case> kCases = {
+    {"no rules", [] (OutputFilter&) {},
+        {"$ ", "ec", "ho\r\n"},
+        {"$ ", "ec", "ho\r\n"}},
+    {"prompt", [] (OutputFilter& f) { f.addRedact("hunter2"); },
+        {"$ ", "", "echo\r\n"},
+        {"", "$ ", "echo\r\n"}},
+    {"split literal", [] (OutputFilter& f) { f.addRedact("hunter2"); },
+        {"$ login hun", "", "ter2", "", "\r\n"},
+        {"", "$ login ", "", "********", "\r\n"}},
+    {"split regex", [] (OutputFilter& f) { f.addRedactRegex("token=[0-9a-f]+"); },
+        {"$ x token=de", "", "adbeef", "", " y", "", "\r\n"},
+        {"", "$ x ", "", "", "", "******** y", "\r\n"}},
+    {"drop", [] (OutputFilter& f) { f.addDropLines("^DEBUG"); },
+        {"DEB", "", "UG secret", "", "\r\n$ ", ""},
+        {"", "", "", "", "", "$ "}},
+    {"long line", [] (OutputFilter& f) { f.addRedact("hunter2"); },
+        {kLongPrefix + "hun", "ter2\r\n"},
+        {kLongPrefix, "********\r\n"}},
+};
+
+}  // namespace
+
+int main() {
+    int failures = 0;
+    for (const auto& c : kCases) {
+        OutputFilter filter;
+        c.configure(filter);
+        for (size_t i = 0; i < c.chunks.size(); i++) {
+            std::string out;
+            if (c.chunks[i].empty()) {
+                filter.flushPartial(out);
+            } else {
+                filter.feed(c.chunks[i], out);
+            }
+            if (out != c.expected[i]) {
+                std::cout << "FAILED  " << c.name << " (chunk " << i << "): expected \"" << c.expected[i] << "\", got \"" << out << "\"" << std::endl;
+                failures++;
+                break;
+            }
+        }
+    }
+    if ( ! failures) {
+        std::cout << "ok      " << kCases.size() << " cases" << std::endl;
+    }
+    return failures ? 1 : 0;
+}